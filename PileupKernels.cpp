@@ -0,0 +1,473 @@
+// PileupKernels.cpp (c) 2026 Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// Scalar and x86 SIMD implementations of the kernels, and choosing them
+//
+
+// CHANGELOG
+//
+//
+//
+// TODO
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "PileupKernels.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KERNELS_X86
+#include <immintrin.h>
+#define TARGET(__t__) __attribute__((target(__t__)))
+#endif
+
+using namespace PileupTools;
+
+const char* const Kernels::names[Kernels::K_END] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+// [.,] as (c | 0x02) == '.', and [ACGTN] either case as (c & 0xdf)
+
+static inline bool
+isPlain(const uint8_t c)
+{
+    const uint8_t u = c & 0xdf;
+    return((c | 0x02) == 0x2e or u == 'A' or u == 'C' or u == 'G' or u == 'T' or u == 'N');
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- scalar, the reference
+
+
+static size_t
+plain_run_scalar(const char* p, const size_t n)
+{
+    size_t r = 0;
+    while (r < n and isPlain(uint8_t(p[r]))) ++r;
+    return(r);
+}
+
+static void
+min_max_scalar(const char* p, const size_t n, uint8_t& lo, uint8_t& hi)
+{
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t c = p[i];
+        if (c < lo) lo = c;
+        if (c > hi) hi = c;
+    }
+}
+
+static void
+histogram_scalar(const char* p, const size_t n, uint32_t counts[256], uint8_t& lo, uint8_t& hi)
+{
+    for (size_t i = 0; i < n; ++i)
+        ++counts[uint8_t(p[i])];
+    min_max_scalar(p, n, lo, hi);
+}
+
+static size_t
+count_at_least_scalar(const char* p, const size_t n, const uint8_t t)
+{
+    size_t c = 0;
+    for (size_t i = 0; i < n; ++i)
+        c += (uint8_t(p[i]) >= t);
+    return(c);
+}
+
+static size_t
+count_both_at_least_scalar(const char* p, const char* q, const size_t n,
+                           const uint8_t tp, const uint8_t tq)
+{
+    size_t c = 0;
+    for (size_t i = 0; i < n; ++i)
+        c += (uint8_t(p[i]) >= tp and uint8_t(q[i]) >= tq);
+    return(c);
+}
+
+
+#ifdef KERNELS_X86
+
+//--------------------------------------------------------
+//--------------------------------- SSE4.2, 16 bytes at a time
+
+// Unsigned x >= t is max(x, t) == x.  Tails shorter than a vector are left
+// to the scalar kernels, as a full load could read past the string.
+
+TARGET("sse4.2") static inline void
+reduce_min_max_sse42(const __m128i vmin, const __m128i vmax, uint8_t& lo, uint8_t& hi)
+{
+    __m128i a = vmin, b = vmax;
+    a = _mm_min_epu8(a, _mm_srli_si128(a, 8));  b = _mm_max_epu8(b, _mm_srli_si128(b, 8));
+    a = _mm_min_epu8(a, _mm_srli_si128(a, 4));  b = _mm_max_epu8(b, _mm_srli_si128(b, 4));
+    a = _mm_min_epu8(a, _mm_srli_si128(a, 2));  b = _mm_max_epu8(b, _mm_srli_si128(b, 2));
+    a = _mm_min_epu8(a, _mm_srli_si128(a, 1));  b = _mm_max_epu8(b, _mm_srli_si128(b, 1));
+    lo = uint8_t(_mm_extract_epi8(a, 0));
+    hi = uint8_t(_mm_extract_epi8(b, 0));
+}
+
+// the string instructions find the first byte outside a set directly
+TARGET("sse4.2") static size_t
+plain_run_sse42(const char* p, const size_t n)
+{
+    const __m128i set = _mm_setr_epi8('.', ',', 'A', 'C', 'G', 'T', 'N',
+                                      'a', 'c', 'g', 't', 'n', 0, 0, 0, 0);
+    size_t r = 0;
+    for (; r + 16 <= n; r += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + r));
+        const int i = _mm_cmpestri(set, 12, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY
+                                   | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return(r + i);
+    }
+    return(r + plain_run_scalar(p + r, n - r));
+}
+
+TARGET("sse4.2") static void
+min_max_sse42(const char* p, const size_t n, uint8_t& lo, uint8_t& hi)
+{
+    size_t i = 0;
+    if (n >= 16) {
+        __m128i vmin = _mm_set1_epi8(char(lo)), vmax = _mm_set1_epi8(char(hi));
+        for (; i + 16 <= n; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+        }
+        reduce_min_max_sse42(vmin, vmax, lo, hi);
+    }
+    min_max_scalar(p + i, n - i, lo, hi);
+}
+
+// Scatter into bins does not vectorise, but quality columns usually hold
+// long runs of one value (often every read at 60), so a vector whose bytes
+// all match its first is counted at once
+TARGET("sse4.2") static void
+histogram_sse42(const char* p, const size_t n, uint32_t counts[256], uint8_t& lo, uint8_t& hi)
+{
+    size_t i = 0;
+    if (n >= 16) {
+        __m128i vmin = _mm_set1_epi8(char(lo)), vmax = _mm_set1_epi8(char(hi));
+        for (; i + 16 <= n; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(p[i]))) == 0xffff) {
+                counts[uint8_t(p[i])] += 16;
+                continue;
+            }
+            for (size_t j = 0; j < 16; ++j)
+                ++counts[uint8_t(p[i + j])];
+        }
+        reduce_min_max_sse42(vmin, vmax, lo, hi);
+    }
+    histogram_scalar(p + i, n - i, counts, lo, hi);
+}
+
+TARGET("sse4.2,popcnt") static size_t
+count_at_least_sse42(const char* p, const size_t n, const uint8_t t)
+{
+    const __m128i vt = _mm_set1_epi8(char(t));
+    size_t c = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        c += _mm_popcnt_u32(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, vt), v)));
+    }
+    return(c + count_at_least_scalar(p + i, n - i, t));
+}
+
+TARGET("sse4.2,popcnt") static size_t
+count_both_at_least_sse42(const char* p, const char* q, const size_t n,
+                          const uint8_t tp, const uint8_t tq)
+{
+    const __m128i vtp = _mm_set1_epi8(char(tp)), vtq = _mm_set1_epi8(char(tq));
+    size_t c = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + i));
+        const __m128i m = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, vtp), a),
+                                        _mm_cmpeq_epi8(_mm_max_epu8(b, vtq), b));
+        c += _mm_popcnt_u32(_mm_movemask_epi8(m));
+    }
+    return(c + count_both_at_least_scalar(p + i, q + i, n - i, tp, tq));
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- AVX2, 32 bytes at a time
+
+// Tails go to the SSE4.2 kernels, after clearing the upper halves of the
+// registers so that their legacy SSE encoding does not stall on them.
+
+TARGET("avx2") static inline void
+reduce_min_max_avx2(const __m256i vmin, const __m256i vmax, uint8_t& lo, uint8_t& hi)
+{
+    reduce_min_max_sse42(_mm_min_epu8(_mm256_castsi256_si128(vmin),
+                                      _mm256_extracti128_si256(vmin, 1)),
+                         _mm_max_epu8(_mm256_castsi256_si128(vmax),
+                                      _mm256_extracti128_si256(vmax, 1)), lo, hi);
+}
+
+TARGET("avx2,bmi") static size_t
+plain_run_avx2(const char* p, const size_t n)
+{
+    const __m256i twos = _mm256_set1_epi8(0x02), dot = _mm256_set1_epi8('.');
+    const __m256i upper = _mm256_set1_epi8(char(0xdf));
+    const __m256i A = _mm256_set1_epi8('A'), C = _mm256_set1_epi8('C'),
+                  G = _mm256_set1_epi8('G'), T = _mm256_set1_epi8('T'),
+                  N = _mm256_set1_epi8('N');
+    size_t r = 0;
+    for (; r + 32 <= n; r += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + r));
+        const __m256i u = _mm256_and_si256(v, upper);
+        __m256i m = _mm256_cmpeq_epi8(_mm256_or_si256(v, twos), dot);
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(u, A), _mm256_cmpeq_epi8(u, C)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(u, G), _mm256_cmpeq_epi8(u, T)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(u, N));
+        const uint32_t other = ~uint32_t(_mm256_movemask_epi8(m));
+        if (other)
+            return(r + _tzcnt_u32(other));
+    }
+    _mm256_zeroupper();
+    return(r + plain_run_sse42(p + r, n - r));
+}
+
+TARGET("avx2") static void
+min_max_avx2(const char* p, const size_t n, uint8_t& lo, uint8_t& hi)
+{
+    size_t i = 0;
+    if (n >= 32) {
+        __m256i vmin = _mm256_set1_epi8(char(lo)), vmax = _mm256_set1_epi8(char(hi));
+        for (; i + 32 <= n; i += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            vmin = _mm256_min_epu8(vmin, v);
+            vmax = _mm256_max_epu8(vmax, v);
+        }
+        reduce_min_max_avx2(vmin, vmax, lo, hi);
+    }
+    _mm256_zeroupper();
+    min_max_sse42(p + i, n - i, lo, hi);
+}
+
+TARGET("avx2") static void
+histogram_avx2(const char* p, const size_t n, uint32_t counts[256], uint8_t& lo, uint8_t& hi)
+{
+    size_t i = 0;
+    if (n >= 32) {
+        __m256i vmin = _mm256_set1_epi8(char(lo)), vmax = _mm256_set1_epi8(char(hi));
+        for (; i + 32 <= n; i += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            vmin = _mm256_min_epu8(vmin, v);
+            vmax = _mm256_max_epu8(vmax, v);
+            if (uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(p[i]))))
+                == 0xffffffffU) {
+                counts[uint8_t(p[i])] += 32;
+                continue;
+            }
+            for (size_t j = 0; j < 32; ++j)
+                ++counts[uint8_t(p[i + j])];
+        }
+        reduce_min_max_avx2(vmin, vmax, lo, hi);
+    }
+    _mm256_zeroupper();
+    histogram_sse42(p + i, n - i, counts, lo, hi);
+}
+
+TARGET("avx2,popcnt") static size_t
+count_at_least_avx2(const char* p, const size_t n, const uint8_t t)
+{
+    const __m256i vt = _mm256_set1_epi8(char(t));
+    size_t c = 0, i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        c += _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, vt), v)));
+    }
+    _mm256_zeroupper();
+    return(c + count_at_least_sse42(p + i, n - i, t));
+}
+
+TARGET("avx2,popcnt") static size_t
+count_both_at_least_avx2(const char* p, const char* q, const size_t n,
+                         const uint8_t tp, const uint8_t tq)
+{
+    const __m256i vtp = _mm256_set1_epi8(char(tp)), vtq = _mm256_set1_epi8(char(tq));
+    size_t c = 0, i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + i));
+        const __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, vtp), a),
+                                           _mm256_cmpeq_epi8(_mm256_max_epu8(b, vtq), b));
+        c += _mm_popcnt_u32(_mm256_movemask_epi8(m));
+    }
+    _mm256_zeroupper();
+    return(c + count_both_at_least_sse42(p + i, q + i, n - i, tp, tq));
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- AVX-512BW, 64 bytes at a time
+
+// Masked loads do not fault on the bytes masked off, so the tail is one
+// more pass rather than a scalar loop
+
+#define AVX512 "avx512f,avx512bw,bmi,popcnt"
+
+TARGET(AVX512) static inline __mmask64
+tail_mask(const size_t left)
+{
+    return(left >= 64 ? ~__mmask64(0) : (__mmask64(1) << left) - 1);
+}
+
+TARGET(AVX512) static size_t
+plain_run_avx512(const char* p, const size_t n)
+{
+    const __m512i twos = _mm512_set1_epi8(0x02), dot = _mm512_set1_epi8('.');
+    const __m512i upper = _mm512_set1_epi8(char(0xdf));
+    const __m512i A = _mm512_set1_epi8('A'), C = _mm512_set1_epi8('C'),
+                  G = _mm512_set1_epi8('G'), T = _mm512_set1_epi8('T'),
+                  N = _mm512_set1_epi8('N');
+    for (size_t r = 0; r < n; r += 64) {
+        const __mmask64 k = tail_mask(n - r);
+        const __m512i v = _mm512_maskz_loadu_epi8(k, p + r);
+        const __m512i u = _mm512_and_si512(v, upper);
+        const __mmask64 m = _mm512_cmpeq_epi8_mask(_mm512_or_si512(v, twos), dot)
+                            | _mm512_cmpeq_epi8_mask(u, A) | _mm512_cmpeq_epi8_mask(u, C)
+                            | _mm512_cmpeq_epi8_mask(u, G) | _mm512_cmpeq_epi8_mask(u, T)
+                            | _mm512_cmpeq_epi8_mask(u, N);
+        const uint64_t other = ~m & k;
+        if (other)
+            return(r + _tzcnt_u64(other));
+    }
+    return(n);
+}
+
+TARGET(AVX512) static void
+min_max_avx512(const char* p, const size_t n, uint8_t& lo, uint8_t& hi)
+{
+    if (n == 0)
+        return;
+    __m512i vmin = _mm512_set1_epi8(char(lo)), vmax = _mm512_set1_epi8(char(hi));
+    for (size_t i = 0; i < n; i += 64) {
+        const __mmask64 k = tail_mask(n - i);
+        const __m512i v = _mm512_maskz_loadu_epi8(k, p + i);
+        vmin = _mm512_mask_min_epu8(vmin, k, vmin, v);
+        vmax = _mm512_mask_max_epu8(vmax, k, vmax, v);
+    }
+    reduce_min_max_avx2(_mm256_min_epu8(_mm512_maskz_extracti64x4_epi64(0x0f, vmin, 0),
+                                        _mm512_maskz_extracti64x4_epi64(0x0f, vmin, 1)),
+                        _mm256_max_epu8(_mm512_maskz_extracti64x4_epi64(0x0f, vmax, 0),
+                                        _mm512_maskz_extracti64x4_epi64(0x0f, vmax, 1)), lo, hi);
+}
+
+TARGET(AVX512) static void
+histogram_avx512(const char* p, const size_t n, uint32_t counts[256], uint8_t& lo, uint8_t& hi)
+{
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const __m512i v = _mm512_loadu_si512(p + i);
+        if (_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(p[i])) == ~__mmask64(0)) {
+            counts[uint8_t(p[i])] += 64;
+            continue;
+        }
+        for (size_t j = 0; j < 64; ++j)
+            ++counts[uint8_t(p[i + j])];
+    }
+    for (; i < n; ++i)
+        ++counts[uint8_t(p[i])];
+    min_max_avx512(p, n, lo, hi);
+}
+
+TARGET(AVX512) static size_t
+count_at_least_avx512(const char* p, const size_t n, const uint8_t t)
+{
+    const __m512i vt = _mm512_set1_epi8(char(t));
+    size_t c = 0;
+    for (size_t i = 0; i < n; i += 64) {
+        const __mmask64 k = tail_mask(n - i);
+        const __m512i v = _mm512_maskz_loadu_epi8(k, p + i);
+        c += _mm_popcnt_u64(_mm512_mask_cmpge_epu8_mask(k, v, vt));
+    }
+    return(c);
+}
+
+TARGET(AVX512) static size_t
+count_both_at_least_avx512(const char* p, const char* q, const size_t n,
+                           const uint8_t tp, const uint8_t tq)
+{
+    const __m512i vtp = _mm512_set1_epi8(char(tp)), vtq = _mm512_set1_epi8(char(tq));
+    size_t c = 0;
+    for (size_t i = 0; i < n; i += 64) {
+        const __mmask64 k = tail_mask(n - i);
+        const __m512i a = _mm512_maskz_loadu_epi8(k, p + i);
+        const __m512i b = _mm512_maskz_loadu_epi8(k, q + i);
+        c += _mm_popcnt_u64(_mm512_mask_cmpge_epu8_mask(_mm512_mask_cmpge_epu8_mask(k, a, vtp),
+                                                        b, vtq));
+    }
+    return(c);
+}
+
+#undef AVX512
+
+#endif // KERNELS_X86
+
+
+//--------------------------------------------------------
+//--------------------------------- choosing
+
+
+static const Kernels kernel_table[Kernels::K_END] = {
+    { Kernels::K_scalar, plain_run_scalar, min_max_scalar, histogram_scalar,
+      count_at_least_scalar, count_both_at_least_scalar },
+#ifdef KERNELS_X86
+    { Kernels::K_sse42, plain_run_sse42, min_max_sse42, histogram_sse42,
+      count_at_least_sse42, count_both_at_least_sse42 },
+    { Kernels::K_avx2, plain_run_avx2, min_max_avx2, histogram_avx2,
+      count_at_least_avx2, count_both_at_least_avx2 },
+    { Kernels::K_avx512, plain_run_avx512, min_max_avx512, histogram_avx512,
+      count_at_least_avx512, count_both_at_least_avx512 },
+#endif
+};
+
+Kernels::Level
+Kernels::supported()
+{
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") and __builtin_cpu_supports("avx512bw")
+        and __builtin_cpu_supports("bmi") and __builtin_cpu_supports("popcnt"))
+        return(K_avx512);
+    if (__builtin_cpu_supports("avx2") and __builtin_cpu_supports("bmi")
+        and __builtin_cpu_supports("popcnt"))
+        return(K_avx2);
+    if (__builtin_cpu_supports("sse4.2") and __builtin_cpu_supports("popcnt"))
+        return(K_sse42);
+#endif
+    return(K_scalar);
+}
+
+// levels beyond what the CPU supports give what it does
+
+const Kernels&
+Kernels::at(const Level l)
+{
+    return(kernel_table[l < supported() ? l : supported()]);
+}
+
+static const Kernels&
+choose()
+{
+    Kernels::Level l = Kernels::supported();
+    if (const char* e = getenv("SMORGAS_KERNELS")) {
+        for (int i = 0; i < Kernels::K_END; ++i)
+            if (std::string(e) == Kernels::names[i] and i < l)
+                l = Kernels::Level(i);
+    }
+    return(kernel_table[l]);
+}
+
+const Kernels&
+PileupTools::kernels()
+{
+    static const Kernels& k = choose();  // once, and thread-safe since C++11
+    return(k);
+}
@@ -0,0 +1,59 @@
+// PileupKernels.h (c) 2026 Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// Byte kernels over the raw columns of a pileup line, each with scalar,
+// SSE4.2, AVX2 and AVX-512BW implementations.  The implementations are all
+// compiled into every build, each function for its own instruction set, and
+// kernels() picks the widest the CPU supports the first time it is called,
+// so one binary runs at full speed on any x86-64.  Other processors get the
+// scalar kernels, which are the reference the others must match; see
+// 'smorgas-bench kernels'.
+//
+// The environment variable SMORGAS_KERNELS set to scalar, sse4.2, avx2 or
+// avx512 caps the choice, to compare or to work around a misbehaving CPU.
+//
+// The table is chosen once and never changes after, so it is safe to use
+// from any number of threads.
+//
+// TODO:
+// --- NEON for aarch64
+
+#ifndef _PILEUPKERNELS_H_
+#define _PILEUPKERNELS_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace PileupTools {
+
+class Kernels {
+public:
+    enum Level { K_scalar = 0, K_sse42, K_avx2, K_avx512, K_END };
+    static const char* const names[K_END];
+
+    Level                   level;
+
+    // length of the run of whole strata at p in a base call column, that is
+    // of [.,ACGTNacgtn], looking at most n bytes
+    size_t                  (*plain_run)(const char* p, const size_t n);
+    // widen lo and hi to the smallest and largest bytes at p
+    void                    (*min_max)(const char* p, const size_t n,
+                                       uint8_t& lo, uint8_t& hi);
+    // add each byte at p to counts, and widen lo and hi as min_max() does
+    void                    (*histogram)(const char* p, const size_t n, uint32_t counts[256],
+                                         uint8_t& lo, uint8_t& hi);
+    // bytes at p that are at least t
+    size_t                  (*count_at_least)(const char* p, const size_t n, const uint8_t t);
+    // positions i < n where p[i] is at least tp and q[i] is at least tq
+    size_t                  (*count_both_at_least)(const char* p, const char* q, const size_t n,
+                                                   const uint8_t tp, const uint8_t tq);
+
+    static Level            supported();  // widest level this CPU runs
+    static const Kernels&   at(const Level l);  // for comparing levels
+};
+
+// The kernels chosen for this CPU and SMORGAS_KERNELS
+const Kernels&              kernels();
+
+} // namespace PileupTools
+
+#endif // _PILEUPKERNELS_H_
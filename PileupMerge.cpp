@@ -0,0 +1,494 @@
+// PileupMerge.cpp (c) 2026 Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// Merge several position-sorted pileups into one multi-sample pileup
+//
+
+// CHANGELOG
+//
+//
+//
+// TODO
+//
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <sys/stat.h>
+
+#include "PileupMerge.h"
+
+namespace PileupTools {
+
+
+//--------------------------------------------------------
+//--------------------------------- class MergeInput
+
+// One input to PileupMerge
+//
+// filename  : file read
+// NL        : line number of head in the file
+// head      : current line, in a block that stays put until next() moves
+//             past it, or 0 once the input is done
+// ref, pos  : contig and position of head; new_ref is set when head moves
+//             onto another contig
+// rank      : of ref in the contig order, kept by PileupMerge
+// columns   : offset in head of the cov column of its first sample, or
+//             std::string::npos if head has too few fields
+// n_samples : sample column sets per line, set by PileupMerge from the
+//             first line, -1 until then
+
+MergeInput::MergeInput(const std::string& fname, const size_t block_lines,
+                       const size_t n_blocks)
+    : filename(fname), NL(0), head(0), ref(""), new_ref(false), pos(0), rank(0),
+      columns(0), n_samples(-1), blocks(n_blocks), block(0), index(0),
+      eof(false), stopping(false)
+{
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        blocks[b].lines.resize(block_lines);
+        blocks[b].n = 0;
+        empty.push_back(&blocks[b]);
+    }
+}
+
+MergeInput::~MergeInput()
+{
+    stop();
+}
+
+bool
+MergeInput::start()
+{
+    stream.open(filename.c_str());
+    if (! stream.is_open())
+        return false;
+    thread = std::thread(&MergeInput::read, this);
+    return true;
+}
+
+void
+MergeInput::stop()
+{
+    if (! thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    emptied.notify_one();
+    thread.join();
+    stream.close();
+}
+
+// The reader thread fills empty blocks, reusing the capacity of their
+// strings, and queues them in input order.  A short block marks the end.
+
+void
+MergeInput::read()
+{
+    for (;;) {
+        Block* b;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            emptied.wait(lock, [this] { return stopping or ! empty.empty(); });
+            if (stopping)
+                return;
+            b = empty.back();
+            empty.pop_back();
+        }
+        size_t n = 0;
+        while (n < b->lines.size() and getline(stream, b->lines[n]))
+            ++n;
+        const bool end = n < b->lines.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            b->n = n;
+            full.push_back(b);
+            eof = end;
+        }
+        filled.notify_one();
+        if (end)
+            return;
+    }
+}
+
+bool
+MergeInput::next()
+{
+    for (;;) {
+        if (block and index < block->n) {
+            head = &block->lines[index++];
+            ++NL;
+            if (head->empty())
+                continue;
+            const size_t t1 = head->find('\t');
+            const size_t t2 = (t1 == std::string::npos) ? t1 : head->find('\t', t1 + 1);
+            const size_t t3 = (t2 == std::string::npos) ? t2 : head->find('\t', t2 + 1);
+            if (t3 == std::string::npos) {
+                columns = std::string::npos;
+                return(true);
+            }
+            new_ref = (head->compare(0, t1, ref) != 0);
+            if (new_ref)
+                ref.assign(*head, 0, t1);
+            pos = strtoul(head->c_str() + t1 + 1, NULL, 10);
+            columns = t3 + 1;
+            return(true);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (block) {  // done with every line in it, so hand it back
+            empty.push_back(block);
+            block = 0;
+            emptied.notify_one();
+        }
+        filled.wait(lock, [this] { return eof or ! full.empty(); });
+        if (full.empty()) {
+            head = 0;
+            return(false);
+        }
+        block = full.front();
+        full.pop_front();
+        index = 0;
+    }
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class PileupMerge
+
+// Merge of position-sorted pileups, see the header
+//
+// join      : join inputs at the same position into one line, else pass
+//             lines through one at a time, equal positions in input order
+// has_map_q : whether the inputs have -s columns, which decides the layout
+//             of the empty sample columns given to inputs without a position
+// bytes     : input bytes merged so far, for progress through the inputs
+// lines     : input lines merged so far
+// joined    : output lines that joined more than one input
+// error     : why get_line() stopped early, empty if it did not
+
+PileupMerge::PileupMerge(const std::vector<std::string>& files, const size_t block_lines)
+    : join(true), has_map_q(true), bytes(0), lines(0), joined(0), error(""),
+      last_rank(0), last_pos(0), started(false)
+{
+    for (size_t i = 0; i < files.size(); ++i)
+        inputs.push_back(new MergeInput(files[i], block_lines));
+}
+
+PileupMerge::~PileupMerge()
+{
+    stop();
+    for (size_t i = 0; i < inputs.size(); ++i)
+        delete inputs[i];
+}
+
+// Contigs listed here are merged in this order, before any not listed
+
+void
+PileupMerge::set_contig_order(const std::vector<std::string>& contigs)
+{
+    for (size_t c = 0; c < contigs.size(); ++c)
+        if (contig_rank.insert(std::make_pair(contigs[c], contig_rank.size())).second)
+            given_order.push_back(contigs[c]);
+}
+
+// The contigs of a pileup file in the order met, one entry for each run of
+// lines on a contig, from a pass that only looks at the first field
+
+static bool
+read_contigs(const std::string& file, std::vector<std::string>& contigs)
+{
+    FILE* f = fopen(file.c_str(), "r");
+    if (! f)
+        return(false);
+    std::vector<char> buf(size_t(1) << 20);
+    std::string ref, last;
+    bool in_ref = true;  // reading the first field of a line
+    size_t n;
+    while ((n = fread(&buf[0], 1, buf.size(), f)) > 0) {
+        const char* p = &buf[0];
+        const char* const end = p + n;
+        while (p < end) {
+            if (! in_ref) {
+                p = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (! p)
+                    break;
+                ++p;
+                in_ref = true;
+                continue;
+            }
+            const char c = *p++;
+            if (c == '\t') {
+                if (ref != last or contigs.empty()) {
+                    contigs.push_back(ref);
+                    last = ref;
+                }
+                in_ref = false;
+            } else if (c == '\n')
+                ref.clear();  // a line of one field, left for the merge to find
+            else
+                ref += c;
+            if (! in_ref)
+                ref.clear();
+        }
+    }
+    const bool ok = ! ferror(f);
+    fclose(f);
+    return(ok);
+}
+
+// Each input's contigs, read ahead on a thread of its own, give an order
+// that contig must follow; the order given does too, and puts its contigs
+// before any others.  These are merged by a topological sort that takes
+// contigs in the order first met wherever the inputs leave a choice.  A
+// cycle means the inputs disagree, or one revisits a contig.
+
+bool
+PileupMerge::order_contigs()
+{
+    std::vector<std::vector<std::string> > input_contigs(inputs.size());
+    std::vector<char> read_ok(inputs.size(), 0);
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        struct stat st;
+        if (stat(inputs[i]->filename.c_str(), &st) != 0 or ! S_ISREG(st.st_mode)) {
+            if (given_order.empty()) {
+                error = inputs[i]->filename + " is not a file, so its contigs cannot be read"
+                        + " ahead to order the merge; a contig order must be given";
+                break;
+            }
+            read_ok[i] = 1;  // the order given is taken to cover it
+            continue;
+        }
+        readers.push_back(std::thread([&input_contigs, &read_ok, this, i] {
+            read_ok[i] = read_contigs(inputs[i]->filename, input_contigs[i]);
+        }));
+    }
+    for (size_t t = 0; t < readers.size(); ++t)
+        readers[t].join();
+    if (! error.empty())
+        return(false);
+
+    std::map<std::string, size_t> id;
+    std::vector<const std::string*> names;
+    std::vector<std::vector<size_t> > after;  // contigs that must follow each
+    std::vector<size_t> n_before;
+    const auto node = [&](const std::string& c) -> size_t {
+        std::map<std::string, size_t>::const_iterator it = id.find(c);
+        if (it != id.end())
+            return(it->second);
+        it = id.insert(std::make_pair(c, names.size())).first;
+        names.push_back(&it->first);
+        after.push_back(std::vector<size_t>());
+        n_before.push_back(0);
+        return(it->second);
+    };
+    const auto edge = [&](const size_t a, const size_t b) {
+        after[a].push_back(b);
+        ++n_before[b];
+    };
+    for (size_t c = 0; c < given_order.size(); ++c) {
+        const size_t n = node(given_order[c]);
+        if (c)
+            edge(n - 1, n);
+    }
+    const size_t n_given = names.size();
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (! read_ok[i]) {
+            error = "could not read " + inputs[i]->filename;
+            return(false);
+        }
+        for (size_t c = 0; c < input_contigs[i].size(); ++c) {
+            const size_t n = node(input_contigs[i][c]);
+            if (n >= n_given and n_given)
+                edge(n_given - 1, n);
+            if (c)
+                edge(id[input_contigs[i][c - 1]], n);
+        }
+    }
+    std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t> > ready;
+    for (size_t n = 0; n < names.size(); ++n)
+        if (! n_before[n])
+            ready.push(n);
+    contig_rank.clear();
+    while (! ready.empty()) {
+        const size_t n = ready.top();
+        ready.pop();
+        const size_t rank = contig_rank.size();
+        contig_rank[*names[n]] = rank;
+        for (size_t a = 0; a < after[n].size(); ++a)
+            if (--n_before[after[n][a]] == 0)
+                ready.push(after[n][a]);
+    }
+    if (contig_rank.size() < names.size()) {
+        for (size_t n = 0; n < names.size(); ++n) {
+            if (! contig_rank.count(*names[n])) {
+                error = "the inputs do not agree on where " + *names[n] + " comes in the order"
+                        + " of contigs; inputs must be sorted, with contigs in the same order";
+                break;
+            }
+        }
+        return(false);
+    }
+    return(true);
+}
+
+bool
+PileupMerge::start()
+{
+    if (join and ! order_contigs())
+        return(false);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (! inputs[i]->start()) {
+            error = "could not open " + inputs[i]->filename;
+            return(false);
+        }
+    }
+    started = true;
+    at_pos.assign(inputs.size(), 0);
+    heap.clear();
+    const auto after = [this](const size_t a, const size_t b) { return(head_after(a, b)); };
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (advance(i)) {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), after);
+        } else if (! error.empty())
+            return(false);
+        else
+            inputs[i]->n_samples = 1;  // an empty input still gets a sample
+    }
+    return(true);
+}
+
+void
+PileupMerge::stop()
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+        inputs[i]->stop();
+}
+
+// Move input i on to its next line and find the rank of its contig, checking
+// that it comes after the line before.  False at the end of the input, or
+// with error set if the input is out of order.
+
+bool
+PileupMerge::advance(const size_t i)
+{
+    MergeInput& in = *inputs[i];
+    const size_t rank = in.rank, pos = in.pos;
+    if (! in.next())
+        return(false);
+    if (in.columns == std::string::npos) {
+        error = in.filename + " line " + std::to_string(in.NL) + " has too few fields";
+        return(false);
+    }
+    bytes += in.head->size() + 1;
+    ++lines;
+    if (in.new_ref) {
+        std::map<std::string, size_t>::const_iterator r = contig_rank.find(in.ref);
+        if (r == contig_rank.end())
+            r = contig_rank.insert(std::make_pair(in.ref, contig_rank.size())).first;
+        in.rank = r->second;
+    }
+    if (in.n_samples < 0) {
+        const int per_sample = has_map_q ? (PileupParser::F_END - PileupParser::F_cov)
+                                         : (PileupParser::F_END - PileupParser::F_cov - 1);
+        const int nf = PileupParser::F_cov + 1
+                       + std::count(in.head->begin() + in.columns, in.head->end(), '\t');
+        in.n_samples = std::max(1, (nf - PileupParser::F_cov) / per_sample);
+    } else if (in.rank < rank
+               or (in.rank == rank and (in.pos < pos or (join and in.pos == pos)))) {
+        error = in.filename + " line " + std::to_string(in.NL) + " " + in.ref + ":"
+                + std::to_string(in.pos) + " is out of order; inputs must be sorted, with"
+                + " contigs in the same order";
+        return(false);
+    }
+    return(true);
+}
+
+// Heap order: true if the head of input a comes after that of input b
+
+bool
+PileupMerge::head_after(const size_t a, const size_t b) const
+{
+    const MergeInput& ia = *inputs[a];
+    const MergeInput& ib = *inputs[b];
+    if (ia.rank != ib.rank) return(ia.rank > ib.rank);
+    if (ia.pos != ib.pos) return(ia.pos > ib.pos);
+    return(a > b);
+}
+
+void
+PileupMerge::empty_columns(std::string& line, const int n_samples) const
+{
+    for (int s = 0; s < n_samples; ++s) {
+        if (s) line += '\t';
+        line += has_map_q ? "0\t*\t*\t*" : "0\t*\t*";
+    }
+}
+
+// Pop the earliest head and any others at the same position, and join them
+// into line, with the reference and reference base from the first.  The
+// inputs are then advanced, which may hand their blocks back to the readers,
+// so line is built first.
+
+bool
+PileupMerge::get_line(std::string& line)
+{
+    if (! started or ! error.empty() or heap.empty())
+        return(false);
+    const auto after = [this](const size_t a, const size_t b) { return(head_after(a, b)); };
+
+    std::pop_heap(heap.begin(), heap.end(), after);
+    const size_t first = heap.back();
+    heap.pop_back();
+    last_rank = inputs[first]->rank;
+    last_pos = inputs[first]->pos;
+
+    if (! join) {
+        line.assign(*inputs[first]->head);
+        if (advance(first)) {
+            heap.push_back(first);
+            std::push_heap(heap.begin(), heap.end(), after);
+        }
+        return(true);
+    }
+
+    at_pos[first] = 1;
+    size_t n_at_pos = 1;
+    while (! heap.empty() and inputs[heap.front()]->rank == last_rank
+           and inputs[heap.front()]->pos == last_pos) {
+        std::pop_heap(heap.begin(), heap.end(), after);
+        at_pos[heap.back()] = 1;
+        heap.pop_back();
+        ++n_at_pos;
+    }
+    if (n_at_pos > 1)
+        ++joined;
+
+    const MergeInput& f = *inputs[first];
+    line.assign(*f.head, 0, f.columns);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (i) line += '\t';
+        if (at_pos[i])
+            line.append(*inputs[i]->head, inputs[i]->columns, std::string::npos);
+        else
+            empty_columns(line, inputs[i]->n_samples);
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (! at_pos[i]) continue;
+        at_pos[i] = 0;
+        if (advance(i)) {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), after);
+        }
+    }
+    return(true);
+}
+
+
+} // namespace PileupTools
+
@@ -0,0 +1,141 @@
+// PileupMerge.h (c) 2026 Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// Merge several position-sorted pileups into one multi-sample pileup
+//
+// Each input is read on its own thread into blocks of lines, which pass to
+// the merge through a short queue and are recycled, so reading overlaps
+// parsing and stops allocating once the blocks have warmed up.  The heads
+// of the inputs are merged by (contig, position) through a heap.  Inputs at
+// the same position are joined into one line with their sample columns in
+// input order, and inputs without that position get empty sample columns,
+// as samtools writes for samples without coverage.
+//
+// Before joining, start() reads ahead through each input for its contigs
+// in order, and merges those lists into one order for the merge, so an
+// input with no lines on a contig does not move it.  Contigs given to
+// set_contig_order() come first, in that order, and others follow in the
+// order the inputs put them in.  Inputs that disagree, or inputs that are
+// not files and so cannot be read ahead without a contig order given, stop
+// start() with error set before any line is merged.  An input found out of
+// order while merging stops the merge with error set.
+//
+// Without join, lines are passed through one at a time rather than joined,
+// which merges sorted runs of one pileup, as PileupSort does.
+//
+// TODO:
+// --- check that inputs agree on the reference base
+
+#ifndef _PILEUPMERGE_H_
+#define _PILEUPMERGE_H_
+
+// Std C/C++ includes
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+#include "PileupParser.h"
+
+namespace PileupTools {
+
+
+//---------------------------------------------------------------
+//--------------------- MergeInput class
+
+
+// One input to PileupMerge, read by its own thread.  next() moves head to
+// the next line and is only called from the merging thread.
+
+class MergeInput {
+public:
+    MergeInput(const std::string& fname,
+               const size_t block_lines = 1024,
+               const size_t n_blocks = 4);
+    ~MergeInput();
+
+    std::string             filename;
+    size_t                  NL;          // line number of head
+    const std::string*      head;        // current line, or 0 at end of input
+    std::string             ref;         // fields of head
+    bool                    new_ref;     // head is on a different contig from the line before
+    size_t                  pos;
+    size_t                  rank;        // of ref in the merge's contig order
+    size_t                  columns;     // offset in head of its first sample column
+    int                     n_samples;   // sample column sets, from the first line
+
+    bool                    start();
+    void                    stop();
+    bool                    next();
+
+private:
+    class Block {
+    public:
+        std::vector<std::string> lines;
+        size_t              n;
+    };
+
+    std::ifstream           stream;
+    std::vector<Block>      blocks;
+    std::deque<Block*>      full;        // filled by the reader, in input order
+    std::vector<Block*>     empty;       // returned by next(), for the reader to fill
+    Block*                  block;       // holding head
+    size_t                  index;       // of the line after head in block
+    bool                    eof;
+    bool                    stopping;
+    std::mutex              mutex;       // guards full, empty, eof and stopping
+    std::condition_variable filled;
+    std::condition_variable emptied;
+    std::thread             thread;
+
+    void                    read();
+};
+
+
+//---------------------------------------------------------------
+//--------------------- PileupMerge class
+
+
+class PileupMerge : public LineSource {
+public:
+    PileupMerge(const std::vector<std::string>& files,
+                const size_t block_lines = 1024);
+    ~PileupMerge();
+
+    bool                    join;        // join inputs at a position, else pass lines through
+    bool                    has_map_q;   // inputs have -s columns, for empty sample columns
+    uint64_t                bytes;       // input bytes merged so far
+    uint64_t                lines;       // input lines merged so far
+    uint64_t                joined;      // output lines joining more than one input
+    std::string             error;       // why the merge stopped early, if it did
+
+    void                    set_contig_order(const std::vector<std::string>& contigs);
+    bool                    start();     // open the inputs, start reading, false with error set
+    void                    stop();
+    virtual bool            get_line(std::string& line);
+
+private:
+    std::vector<MergeInput*> inputs;
+    std::vector<size_t>     heap;        // inputs with a head, earliest on top
+    std::vector<char>       at_pos;      // inputs whose heads go into the current line
+    std::vector<std::string> given_order; // by set_contig_order()
+    std::map<std::string, size_t> contig_rank;
+    size_t                  last_rank;   // position of the last line merged
+    size_t                  last_pos;
+    bool                    started;
+
+    bool                    order_contigs();  // contig_rank from the inputs, before joining
+    bool                    advance(const size_t i);  // next() and rank, false at end
+    bool                    head_after(const size_t a, const size_t b) const;
+    void                    empty_columns(std::string& line, const int n_samples) const;
+};
+
+
+} // namespace PileupTools
+
+
+#endif // _PILEUPMERGE_H_
@@ -38,23 +38,27 @@ MA_1    1911    N       7       ggggggG ;;;;;;;
 MA_1    1912    G       14      ,^>.^6.,^0.,,,^>.^6.^6.^>.,.    >>>>>>>>>>>>>>
 MA_1    1913    T       15      ,..,.,,,....^8.,.       HHHHHHHHHHHHBHH
 */
-// --- analyze high-quality coverage
+// -x- analyze high-quality coverage: Pileup::hq_cov, counted during parse,
+//     reported by --hq-coverage and in smorgas_position
 // --- raw heterozygosity
 // --- model-based heterozygosity
-// --- multiple BAMs in pileup input; handle with stack that parallels the strata
-//     and indicates which BAM in sequence they came from... or maybe keep track
-//     only of intervals that give us slices from which to take raw and parsed
-//     data
-// --- check for unsorted input
-// --- solve read mapping quality from reads if separate column not available;
-//     handle with stack that parallels the strata and tracks read quality for
-//     each stratum as reads are introduced and removed
+// -x- multiple BAMs in pileup input: each stratum records its sample, and
+//     SampleSummary splits the tallies; PileupMerge joins separate pileups
+// -x- check for unsorted input: parse_line_lite() counts D_unsorted, scan()
+//     samples for it, and --unsorted sorts with PileupSort
+// -x- solve read mapping quality from reads if separate column not available:
+//     the ReadStack carries each read's ^q mapping quality to its strata
 //
 
 #include "PileupParser.h"
+#include "PileupKernels.h"
+
+#include <cstring>
 
 namespace PileupTools {
 
+static const std::string no_field("");  // stands in for absent columns
+
 
 //--------------------------------------------------------
 //--------------------------------- class PileupParser
@@ -64,20 +68,28 @@ namespace PileupTools {
 
 PileupParser::PileupParser(const std::string& fname)
     : filename(fname), FS('\t'), RS('\n'), NL(0), NF(0),
-      min_base_quality(0), min_map_quality(33), line(""), fields(7),
+      min_base_quality(0), min_map_quality(33),
+      base_quality_threshold(0), map_quality_threshold(0), line(""), fields(7),
+      has_map_q(true), n_samples(0), n_references(0), new_reference(false),
+      max_pile_depth(0), max_depth(0), read_end_hook(0), line_source(0),
       min_base_quality_seen(0xff), max_base_quality_seen(0x00),
       min_map_quality_seen(0xff), max_map_quality_seen(0x00),
-      debug_level(0)
+      debug_level(0), line_pending(false),
+      parse_pile_fn(&PileupParser::parse_pile_policy< ParsePolicy<true, true, true, 0> >)
 {
     open(filename);
 }
 
 PileupParser::PileupParser()
     : filename(""), FS('\t'), RS('\n'), NL(0), NF(0),
-      min_base_quality(0), min_map_quality(33), line(""), fields(7),
+      min_base_quality(0), min_map_quality(33),
+      base_quality_threshold(0), map_quality_threshold(0), line(""), fields(7),
+      has_map_q(true), n_samples(0), n_references(0), new_reference(false),
+      max_pile_depth(0), max_depth(0), read_end_hook(0), line_source(0),
       min_base_quality_seen(0xff), max_base_quality_seen(0x00),
       min_map_quality_seen(0xff), max_map_quality_seen(0x00),
-      debug_level(0)
+      debug_level(0), line_pending(false),
+      parse_pile_fn(&PileupParser::parse_pile_policy< ParsePolicy<true, true, true, 0> >)
 {
 }
 
@@ -94,6 +106,7 @@ PileupParser::open(const std::string& fname)
     stream.open(filename.c_str());
     NL = 0;
     line = "";
+    line_pending = false;
 }
 
 void
@@ -105,25 +118,36 @@ PileupParser::close()
 int
 PileupParser::read_line()
 {
+    if (line_pending) {
+        line_pending = false;
+        return(NF);
+    }
     NF = 0;
-    if (getline(stream, line, RS)) {
+    uint64_t t = stats.timing ? StageTimer::now() : 0;
+    if (line_source ? line_source->get_line(line) : bool(getline(stream, line, RS))) {
     	++NL;
+        stats.bytes += line.size() + 1;
+        if (stats.timing) t = stats.io.lap(t);
         if (debug(2)) std::cerr << "line " << NL << " :" << line << ":" << std::endl;
-        // process line fields
+        // process line fields; with multiple samples there are F_END - F_cov
+        // (or one fewer without -s) further fields for each sample
         size_t pos = 0, f;
-        for (f = 0; f < F_END; ++f) {  // TODO: handle multiple BAMs here
+        for (f = 0; ; ++f) {
+            if (f == fields.size())
+                fields.resize(f + 1);
             size_t t = line.find(FS, pos);
             if (t != std::string::npos) {
-                fields[f] = line.substr(pos, t - pos);
+                fields[f].assign(line, pos, t - pos);  // keeps capacity, unlike substr()
                 if (debug(3)) std::cerr << "field " << f << " :" << fields[f] << ":" << std::endl;
                 pos = t + 1;  // skip the FS
             } else {  // no FS, so last field is the remainder of the line
-                fields[f] = line.substr(pos);
+                fields[f].assign(line, pos, std::string::npos);
                 if (debug(3)) std::cerr << "last field " << f << " :" << fields[f] << ":" << std::endl;
                 break;
             }
         }
         NF = f + 1;
+        if (stats.timing) stats.tokenize.lap(t);
     }
     return(NF);
 }
@@ -138,7 +162,7 @@ PileupParser::parse_line()
     parse_line_lite();
     parse_pile();
     // here, parse_state will be (PS_lite | PS_pile) == PS_all
-    if (debug(1) && NL % 10 == 0)
+    if (debug(2) && NL % 10 == 0)
         print_read_stack(std::cerr);
 }
 
@@ -153,45 +177,301 @@ PileupParser::parse_line_lite()
 {
     const char* const thisfunc = "parse_line_lite";
     if (line == "") { std::cerr << thisfunc << ": no line to parse" << std::endl; return; }
-    if (references.size() == 0 or fields[F_ref] != references.back()) { // assumes input sorted
+    // sorted input is assumed, and checked here at the cost of a hash per
+    // contig and a comparison per line
+    const size_t last_pos = pileup.pos;
+    new_reference = (references.size() == 0 or fields[F_ref] != references.back());
+    if (new_reference) {
+        if (! reference_hashes.insert(std::hash<std::string>()(fields[F_ref])).second
+            and diagnostics.count(Diagnostics::D_unsorted))
+            diagnostics.example(Diagnostics::D_unsorted, NL, 0, "revisits " + fields[F_ref]);
         references.push_back(fields[F_ref]);
+        ++n_references;
     }
     pileup.ref = references.back();
     pileup.pos = atol(fields[F_pos].c_str());
+    if (! new_reference and pileup.pos <= last_pos and diagnostics.count(Diagnostics::D_unsorted))
+        diagnostics.example(Diagnostics::D_unsorted, NL, 0,
+                            pileup.ref + ":" + std::to_string(pileup.pos) + " after "
+                            + std::to_string(last_pos));
     pileup.refbase = fields[F_refbase][0];
-    pileup.cov = atol(fields[F_cov].c_str());
-    pileup.raw_base_call = &fields[F_base_call];
-    pileup.raw_base_quality = &fields[F_base_q];
-    pileup.raw_map_quality = &fields[F_map_q];
+    // each sample has cov, base call and base quality columns, plus mapping
+    // quality if -s was given; a line with one column too few per sample is
+    // taken to lack mapping qualities
+    int per_sample = has_map_q ? (F_END - F_cov) : (F_END - F_cov - 1);
+    if ((NF - F_cov) % per_sample != 0 and (NF - F_cov) % (F_END - F_cov - 1) == 0)
+        per_sample = F_END - F_cov - 1;
+    n_samples = (NF - F_cov) / per_sample;
+    if ((n_samples == 0 or (NF - F_cov) % per_sample != 0)
+        and diagnostics.count(Diagnostics::D_fields))
+        diagnostics.example(Diagnostics::D_fields, NL, 0, std::to_string(NF) + " fields");
+    pileup.n_samples = n_samples;
+    pileup.sample_cov.resize(n_samples);
+    pileup.sample_base_call.resize(n_samples);
+    pileup.sample_base_quality.resize(n_samples);
+    pileup.sample_map_quality.resize(n_samples);
+    pileup.cov = 0;
+    for (int s = 0; s < n_samples; ++s) {
+        const int f = F_cov + s * per_sample;
+        pileup.sample_cov[s] = atol(fields[f].c_str());
+        pileup.sample_base_call[s] = &fields[f + F_base_call - F_cov];
+        pileup.sample_base_quality[s] = &fields[f + F_base_q - F_cov];
+        pileup.sample_map_quality[s] = (per_sample == F_END - F_cov)
+                                       ? &fields[f + F_map_q - F_cov] : &no_field;
+        pileup.cov += pileup.sample_cov[s];
+    }
+    pileup.raw_base_call = n_samples ? pileup.sample_base_call[0] : &no_field;
+    pileup.raw_base_quality = n_samples ? pileup.sample_base_quality[0] : &no_field;
+    pileup.raw_map_quality = n_samples ? pileup.sample_map_quality[0] : &no_field;
     pileup.parse_state = Pileup::PS_lite;
     // do not do parse_pile() here
 }
 
+// parse_pile() goes through parse_pile_fn to one instantiation of
+// parse_pile_policy<>(), chosen by select_parse_policy() to suit the input and
+// what the caller needs from the pile; the default handles everything.
+// Policy members are compile-time constants, so the branches they guard
+// below vanish from instantiations that do not need them.
+
 void
 PileupParser::parse_pile()
 {
-    const char* const thisfunc = "parse_pile";
+    if (stats.timing) {
+        const uint64_t t = StageTimer::now();
+        (this->*parse_pile_fn)();
+        stats.parse_pile.lap(t);
+    } else
+        (this->*parse_pile_fn)();
+}
+
+// Classes of characters in the base call column, as bit flags.  The table
+// is built at compile time from baseCallClass().
+
+enum { BC_other = 0x00,  // not part of the grammar, counted as unknown
+       BC_fwd   = 0x01,  // forward orientation: . and [ACGTN]
+       BC_ref   = 0x02,  // matches reference: [.,]
+       BC_base  = 0x04,  // does not match reference: [ACGTNacgtn]
+       BC_gap   = 0x08,  // continuation of a deletion: *
+       BC_start = 0x10,  // read start, followed by mapping quality: ^
+       BC_end   = 0x20,  // read end: $
+       BC_indel = 0x40   // indel, followed by length and sequence: [+-]
+};
+
+static constexpr uchar_t
+baseCallClass(const int c)
+{
+    return(c == '.' ? (BC_ref | BC_fwd) :
+           c == ',' ? BC_ref :
+           (c == 'A' or c == 'C' or c == 'G' or c == 'T' or c == 'N') ? (BC_base | BC_fwd) :
+           (c == 'a' or c == 'c' or c == 'g' or c == 't' or c == 'n') ? BC_base :
+           c == '*' ? BC_gap :
+           c == '^' ? BC_start :
+           c == '$' ? BC_end :
+           (c == '+' or c == '-') ? BC_indel :
+           BC_other);
+}
+
+#define BC4(__c__)  baseCallClass(__c__), baseCallClass(__c__ + 1), \
+                    baseCallClass(__c__ + 2), baseCallClass(__c__ + 3)
+#define BC16(__c__) BC4(__c__), BC4(__c__ + 4), BC4(__c__ + 8), BC4(__c__ + 12)
+#define BC64(__c__) BC16(__c__), BC16(__c__ + 16), BC16(__c__ + 32), BC16(__c__ + 48)
+static constexpr uchar_t base_call_class[256] = { BC64(0), BC64(64), BC64(128), BC64(192) };
+#undef BC64
+#undef BC16
+#undef BC4
+
+// The tail of parsing a stratum, shared by the general path and the path
+// for runs of plain strata: qualities have their offsets removed and the
+// strata passing thresholds are tracked here, in the same pass as the base
+// call.  The range of raw qualities is taken a column at a time instead.
+
+template<class Policy> inline void
+PileupParser::parse_stratum_qualities(Stratum& st, const size_t stratum, const size_t q,
+                                      const std::string& base_quality,
+                                      const std::string& map_quality,
+                                      const bool sample_map_q, const uchar_t base_q_offset,
+                                      const uchar_t raw_read_map_q)
+{
+    uchar_t raw_base_q = 0, raw_map_q = 0;
+    if (q < base_quality.size()) {
+        raw_base_q = base_quality[q];
+        st.base_q = offsetQuality(raw_base_q, base_q_offset);
+    } else if (diagnostics.count(Diagnostics::D_base_q_short))
+        diagnostics.example(Diagnostics::D_base_q_short, NL, stratum,
+                            "base quality length " + std::to_string(base_quality.size()));
+
+    if (sample_map_q) {
+        if (q < map_quality.size()) {
+            raw_map_q = map_quality[q];
+            st.map_q = offsetQuality(raw_map_q, min_map_quality);
+        } else if (diagnostics.count(Diagnostics::D_map_q_short))
+            diagnostics.example(Diagnostics::D_map_q_short, NL, stratum,
+                                "mapping quality length " + std::to_string(map_quality.size()));
+    }
+    if (Policy::keep_indels and st.indel)
+        st.indel->map_q = st.map_q;
+
+    if (Policy::map_q and raw_read_map_q and raw_map_q and raw_map_q != raw_read_map_q
+        and diagnostics.count(Diagnostics::D_read_map_q))
+        diagnostics.example(Diagnostics::D_read_map_q, NL, stratum,
+                            std::string("read start '") + char(raw_read_map_q)
+                            + "' vs -s '" + char(raw_map_q) + "'");
+
+    if (st.base_q >= base_quality_threshold and st.map_q >= map_quality_threshold) {
+        ++pileup.hq_cov;
+        ++pileup.sample_hq_cov[st.sample];
+        const int b = baseIndex(st.base);
+        if (b >= 0) ++pileup.hq_base_count[b];
+    }
+}
+
+// Strata not kept by max_depth sampling still count toward hq_cov, as they
+// do toward cov, but only their qualities are looked at
+
+template<class Policy> inline void
+PileupParser::count_sampled_out(const Stratum& st, const size_t q,
+                                const std::string& base_quality,
+                                const std::string& map_quality,
+                                const bool sample_map_q, const uchar_t base_q_offset)
+{
+    const uchar_t base_q = q < base_quality.size()
+                           ? offsetQuality(base_quality[q], base_q_offset) : 0;
+    const uchar_t map_q = (sample_map_q and q < map_quality.size())
+                          ? offsetQuality(map_quality[q], min_map_quality) : st.map_q;
+    if (base_q >= base_quality_threshold and map_q >= map_quality_threshold) {
+        ++pileup.hq_cov;
+        ++pileup.sample_hq_cov[st.sample];
+    }
+}
+
+// Keys for sampling strata under max_depth, uniform over 32 bits and fixed
+// by the reference, position and stratum, so repeated runs sample the same.
+
+static inline uint32_t
+stratumKey(const uint64_t ref, const uint64_t pos, const uint64_t stratum)
+{
+    uint64_t x = (ref * 0x9e3779b97f4a7c15ULL) ^ (pos * 0xbf58476d1ce4e5b9ULL) ^ stratum;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return(uint32_t((x ^ (x >> 31)) >> 32));
+}
+
+// The key of the read a stratum belongs to, given by the read start so the
+// read is kept or dropped along its whole length, or if the read is not on
+// the read stack, a key for the stratum at this position alone.
+
+template<class Policy> inline uint32_t
+PileupParser::stratum_key(const size_t stratum, const size_t rs) const
+{
+    if (Policy::track_reads and rs < read_stack.size())
+        return(read_stack[rs].key);
+    return(stratumKey(n_references, pileup.pos, stratum));
+}
+
+// Note a stratum sampled out, and that its read, if tracked, is incomplete.
+
+template<class Policy> inline void
+PileupParser::sample_out(const size_t rs, size_t& n_sampled_out)
+{
+    ++n_sampled_out;
+    if (Policy::track_reads and rs < read_stack.size())
+        read_stack[rs].sampled_out = true;
+}
+
+// A stratum with no read on the stack belongs to a read open before the
+// input began, as in a region or a pileup cut from a larger one.  It gets a
+// placeholder so that reads above it keep their places on the stack; the
+// placeholder has no mapping quality and is never passed to the ReadEndHook.
+
+void
+PileupParser::read_unstarted(const size_t stratum, const size_t rs,
+                             const readdir_t dir, const int16_t sample)
+{
+    if (diagnostics.count(Diagnostics::D_reads_unstarted))
+        diagnostics.example(Diagnostics::D_reads_unstarted, NL, stratum,
+                            pileup.ref + ":" + std::to_string(pileup.pos));
+    Read r(stratum, pileup.pos, 0, dir, sample);
+    r.key = stratumKey(n_references, pileup.pos, stratum);
+    r.unstarted = true;
+    read_stack.insert(read_stack.begin() + std::min(rs, read_stack.size()), r);
+}
+
+// The Stratum the next stratum is parsed into, the next in the pile or
+// overflow if the pile is full or the stratum is not kept.
+
+static inline Stratum&
+nextStratum(Pile& pile, const size_t pile_limit, const bool keep, Stratum& overflow)
+{
+    if (keep and pile.size() < pile_limit) {
+        pile.push_back(Stratum());
+        return(pile.back());
+    }
+    overflow = Stratum();
+    return(overflow);
+}
+
+template<class Policy> void
+PileupParser::parse_pile_policy()
+{
+    const uchar_t base_q_offset = Policy::base_quality_offset ? Policy::base_quality_offset
+                                                              : min_base_quality;
+
+    const Kernels& kern = kernels();
 
     pileup.reset_pile();  // does not affect anything done by parse_line_lite()
 
     Pile& pile = pileup.pile;
 
-    pile.resize(pileup.cov);
+    // reads cannot continue onto a new reference, so any still open were
+    // never closed with '$'; drop them so the read stack stays bounded
+    if (Policy::track_reads and new_reference and ! read_stack.empty()) {
+        if (diagnostics.count(Diagnostics::D_reads_unended))
+            diagnostics.example(Diagnostics::D_reads_unended, NL, 0,
+                                std::to_string(read_stack.size()) + " reads before " + pileup.ref);
+        diagnostics.counts[Diagnostics::D_reads_unended] += read_stack.size() - 1;
+        read_stack.clear();
+    }
 
-    size_t stratum = 0; // position within pile (in terms of strata)
+    // with max_pile_depth, strata beyond it are parsed into overflow and only
+    // contribute to coverage counts and the read stack, not to the pile
+    const size_t pile_limit = max_pile_depth ? max_pile_depth
+                                             : std::numeric_limits<size_t>::max();
+    // with max_depth, deeper positions keep a stratum only if its key is below
+    // key_limit, about max_depth of them; sampled-out strata are parsed into
+    // overflow too, and only their qualities are looked at, for hq_cov
+    const bool sampling = max_depth and size_t(pileup.cov) > max_depth;
+    const uint64_t key_limit = sampling ? (uint64_t(max_depth) << 32) / pileup.cov
+                                        : (uint64_t(1) << 32);
+    Stratum overflow;
+    const size_t expected = std::min(size_t(pileup.cov), pile_limit);
+    pile.reserve(sampling ? std::min(expected, max_depth + max_depth / 2) : expected);
+    if (Policy::keep_indels)
+        pileup.indels.reserve(expected + 1);  // at most one per stratum kept
+    size_t n_sampled_out = 0;
+
+    size_t stratum = 0; // position within pile (in terms of strata), across samples
+    size_t n_ended = 0; // reads ended so far on this line, already erased from read_stack
+
+    for (int s = 0; s < pileup.n_samples; ++s) {
+
+    if (pileup.sample_cov[s] == 0) continue;  // the base call column may still hold '*' so don't even go there
+
+    const std::string& base_call = *pileup.sample_base_call[s];
+    const std::string& base_quality = *pileup.sample_base_quality[s];
+    const std::string& map_quality = *pileup.sample_map_quality[s];
+    const bool sample_map_q = Policy::map_q and ! map_quality.empty();
+    const size_t sample_start = stratum; // first stratum of this sample in the pile
+    const char* const bc = base_call.data();
+    const size_t n = base_call.length();
     size_t i = 0; // position within base string, contains other info
 
-    while (i < pileup.raw_base_call->length()) {
+    kern.min_max(base_quality.data(), base_quality.size(),
+                 min_base_quality_seen, max_base_quality_seen);
+    if (sample_map_q)
+        kern.min_max(map_quality.data(), map_quality.size(),
+                     min_map_quality_seen, max_map_quality_seen);
 
-        if (pileup.cov == 0) break;  // the base call column may still hold '*' so don't even go there
-
-        if (stratum == pile.size()) {
-            std::cerr << "NL=" << NL << " i=" << i <<" stratum=" << stratum
-                << " RESIZING pile from " << pile.size();
-            pile.resize(pile.size() + 1);
-            //pile.resize(pileup.cov + int(pileup.cov / 2));
-            std::cerr << " to " << pile.size() << std::endl;
-        }
+    while (i < n) {
 
         // Each base call entry can be one of several types.
         // TODO: does this cover it?  Can we have IUPAC or length > 1?
@@ -214,122 +494,210 @@ PileupParser::parse_pile()
         // b$        : read ends here, reverse orientation, does not match ref
         // *         : position is a continuation of a deletion in the read at this stratum
         //
+        // An indel may itself be followed by $ if the read ends here.
+        //
+        // Each character is classified by base_call_class[], and an entry is
+        // an optional start, a base, then an optional indel and optional end.
+
+        uchar_t c0 = bc[i];
+        uchar_t k0 = base_call_class[c0];
+
+        if (k0 & (BC_ref | BC_base)) {
+            // In a run of plain [.,ACGTNacgtn] every character but the last is
+            // a whole stratum, since it is followed by another rather than an
+            // indel or end; take those without further tokenizing.  The last
+            // goes through the general path below.
+            const size_t run_end = i + kern.plain_run(bc + i, n - i) - 1;
+            for (; i < run_end; ++i, ++stratum) {
+                const uchar_t k = base_call_class[uchar_t(bc[i])];
+                const readdir_t dir = (k & BC_fwd) ? RD_fwd : RD_rev;
+                const size_t rs = stratum - n_ended;
+                if (Policy::track_reads and rs >= read_stack.size())
+                    read_unstarted(stratum, rs, dir, s);
+                const bool keep = ! sampling or stratum_key<Policy>(stratum, rs) < key_limit;
+                Stratum& st = nextStratum(pile, pile_limit, keep, overflow);
+                st.sample = s;
+                st.dir = dir;
+                st.base = (k & BC_ref) ? pileup.refbase : toupper(bc[i]);
+                if (! Policy::map_q and Policy::track_reads)
+                    st.map_q = read_stack[rs].map_q;
+                if (keep)
+                    parse_stratum_qualities<Policy>(st, stratum, stratum - sample_start,
+                                                    base_quality, map_quality, sample_map_q,
+                                                    base_q_offset, 0);
+                else {
+                    count_sampled_out<Policy>(st, stratum - sample_start, base_quality,
+                                              map_quality, sample_map_q, base_q_offset);
+                    sample_out<Policy>(rs, n_sampled_out);
+                }
+            }
+            c0 = bc[i];
+        }
 
-        uchar_t c0 = (*pileup.raw_base_call)[i];
+        // reads that ended earlier on this line are gone from the read stack,
+        // so the read for this stratum sits that much lower in it
+        const size_t rs = stratum - n_ended;
+        k0 = base_call_class[c0];
+        if (Policy::track_reads and ! (k0 & BC_start) and rs >= read_stack.size())
+            read_unstarted(stratum, rs, (k0 & BC_fwd) ? RD_fwd : RD_rev, s);
 
-        if (c0 == '^') {  // if read start, eat it and move to next character
+        // a read starting here gets its key now, others have it on the stack
+        uint32_t key = 0;
+        if (sampling)
+            key = (k0 & BC_start) ? stratumKey(n_references, pileup.pos, stratum)
+                                  : stratum_key<Policy>(stratum, rs);
+        const bool keep = ! sampling or key < key_limit;
+        Stratum& st = nextStratum(pile, pile_limit, keep, overflow);
+
+        st.sample = s;
+
+        uchar_t raw_read_map_q = 0;  // set if the read starts here
+
+        if (k0 & BC_start) {  // if read start, eat it and move to next character
+
+            raw_read_map_q = bc[i + 1];
+            c0 = (i + 2 < n) ? bc[i + 2] : 0;
+            k0 = base_call_class[c0];
+            ++stats.read_starts;
 
             // read stack
-            Read new_read(stratum, pileup.pos, (*pileup.raw_base_call)[i + 1],
-                          (isForward((*pileup.raw_base_call)[i + 2]) ? RD_fwd : RD_rev));
-            read_stack.insert(read_stack.begin() + stratum, new_read);
+            if (Policy::track_reads) {
+                const uint64_t t = stats.timing ? StageTimer::now() : 0;
+                Read new_read(stratum, pileup.pos, offsetQuality(raw_read_map_q, min_map_quality),
+                              ((k0 & BC_fwd) ? RD_fwd : RD_rev), s);
+                new_read.key = key;
+                read_stack.insert(read_stack.begin() + std::min(rs, read_stack.size()), new_read);
+                if (stats.timing) stats.read_stack.lap(t);
+            }
 
             // stratum
-            pile[stratum].read_str = RS_start;
-            pile[stratum].read_map_q = (*pileup.raw_base_call)[i + 1];
+            st.read_str = RS_start;
+            st.read_map_q = offsetQuality(raw_read_map_q, min_map_quality);
             i += 2;
-            c0 = (*pileup.raw_base_call)[i];
 
         }
-
-        switch (c0) { // read direction (. or ,) or base, optionally followed by $, or *
-            case '.':
-                pile[stratum].dir = RD_fwd;
-                pile[stratum].base = pileup.refbase;
-                break;
-            case ',':
-                pile[stratum].dir = RD_rev;
-                pile[stratum].base = pileup.refbase;
-                break;
-            case 'A': case 'C': case 'G': case 'T': case 'N':
-                pile[stratum].dir = RD_fwd;
-                pile[stratum].base = c0;
-                break;
-            case 'a': case 'c': case 'g': case 't': case 'n':
-                pile[stratum].dir = RD_rev;
-                pile[stratum].base = toupper(c0);
-                break;
-            case '*':
-                pile[stratum].base = '*';
-                pile[stratum].read_str = RS_gap;
-                ++read_stack[stratum].bp_gap;
-                break;
-            default:
-                std::cerr << thisfunc << ": line " << NL << " stratum " << stratum
-                    << " unknown base call character: " << c0 << std::endl;
-                break;
+        if (! keep)
+            sample_out<Policy>(rs, n_sampled_out);
+        if (! Policy::map_q and Policy::track_reads)
+            st.map_q = read_stack[rs].map_q;  // before the read can end below
+
+        // read direction (. or ,) or base, optionally followed by $, or *
+        if (k0 & BC_ref) {
+            st.dir = (k0 & BC_fwd) ? RD_fwd : RD_rev;
+            st.base = pileup.refbase;
+        } else if (k0 & BC_base) {
+            st.dir = (k0 & BC_fwd) ? RD_fwd : RD_rev;
+            st.base = toupper(c0);
+        } else if (k0 & BC_gap) {
+            st.base = '*';
+            st.read_str = RS_gap;
+            if (Policy::track_reads and rs < read_stack.size())
+                ++read_stack[rs].bp_gap;
+        } else {
+            if (diagnostics.count(Diagnostics::D_unknown_base_call))
+                diagnostics.example(Diagnostics::D_unknown_base_call, NL, stratum,
+                                    std::string("'") + char(c0) + "'");
         }
 
-        uchar_t c1 = lookAhead((*pileup.raw_base_call), (i + 1));  // returns next char or 0 if end of string
+        uchar_t k1 = (i + 1 < n) ? base_call_class[uchar_t(bc[i + 1])] : 0;
 
-        if (isIndel(c1)) {   // [+-]#+[Bb]+
+        if (k1 & BC_indel) {   // [+-]#+[Bb]+
 
             // we have already seen the leading . or ,
             // eat [+-]#+ for indel size, then use abs(indel size) to eat the sequence
 
             size_t j = i + 1, k = 0;  // start at '+' or '-', k will be first non-numeric char
-            int32_t indel_size = extractNumber((*pileup.raw_base_call), j, k);
-            Indel indel(indel_size, pileup.raw_base_call->substr(k, abs(indel_size)), stratum);
-            pileup.indels.push_back(indel);
-            pile[stratum].indel = &pileup.indels.back();  // new spot in indels stack
+            int32_t indel_size = extractNumber(base_call, j, k);
+            if (size_t(abs(indel_size)) > n - k) {  // k <= n, at the end of the digits
+                if (diagnostics.count(Diagnostics::D_malformed_indel))
+                    diagnostics.example(Diagnostics::D_malformed_indel, NL, stratum,
+                                        "length " + std::to_string(abs(indel_size)) + " with "
+                                        + std::to_string(n - k) + " characters left");
+                indel_size = indel_size < 0 ? -int32_t(n - k) : int32_t(n - k);
+            }
+            ++stats.indels;
+            for (size_t j = k; j < k + size_t(abs(indel_size)); ++j)
+                if (! (base_call_class[uchar_t(bc[j])] & BC_base)
+                    and diagnostics.count(Diagnostics::D_unknown_base_call))
+                    diagnostics.example(Diagnostics::D_unknown_base_call, NL, stratum,
+                                        std::string("'") + bc[j] + "' in indel");
+            if (Policy::keep_indels and &st != &overflow
+                and pileup.indels.size() < pileup.indels.capacity()) {
+                // capacity was reserved up front, so this never reallocates and
+                // pointers to earlier indels stay good
+                pileup.indels.push_back(Indel(indel_size, bc + k, st.dir, pileup.arena, stratum));
+                st.indel = &pileup.indels.back();  // new spot in indels stack
+            }
+            if (Policy::track_reads and indel_size > 0 and rs < read_stack.size())
+                read_stack[rs].bp_insert += indel_size;
             i = k + abs(indel_size) - 1;  // i points to last char of indel sequence
+            k1 = (i + 1 < n) ? base_call_class[uchar_t(bc[i + 1])] : 0;
 
-        } else if (c1 == '$') {
+        }
+
+        if (k1 & BC_end) {
+
+            ++stats.read_ends;
 
             // read stack
-            read_stack[stratum].end_pos = pileup.pos;
-            read_stack[stratum].aligned_length = read_stack[stratum].end_pos - read_stack[stratum].start_pos;
-            read_stack.erase(read_stack.begin() + stratum);
+            if (Policy::track_reads and rs < read_stack.size()) {
+                uint64_t t = stats.timing ? StageTimer::now() : 0;
+                read_stack[rs].end_pos = pileup.pos;
+                read_stack[rs].aligned_length = read_stack[rs].end_pos - read_stack[rs].start_pos;
+                if (read_end_hook and ! read_stack[rs].sampled_out
+                    and ! read_stack[rs].unstarted) {
+                    read_end_hook->read_end(read_stack[rs], pileup);
+                    if (stats.timing) t = stats.read_end_hook.lap(t);
+                }
+                read_stack.erase(read_stack.begin() + rs);
+                if (stats.timing) stats.read_stack.lap(t);
+                ++n_ended;
+            }
 
             // stratum
-            pile[stratum].read_str = RS_end;
+            st.read_str = RS_end;
             i += 1;
 
         }
 
         // after all that mess, the base and mapping quality columns are easy
-        if (stratum < pileup.raw_base_quality->size())
-            pile[stratum].base_q = (*pileup.raw_base_quality)[stratum];
+        if (keep)
+            parse_stratum_qualities<Policy>(st, stratum, stratum - sample_start,
+                                            base_quality, map_quality, sample_map_q,
+                                            base_q_offset, raw_read_map_q);
         else
-            std::cerr << "NL=" << NL << " stratum=" << stratum
-                << " exceeds length of base_q" << std::endl;
-
-        if ((*pileup.raw_map_quality) != "") {
-            if (stratum < pileup.raw_map_quality->size())
-                pile[stratum].map_q = (*pileup.raw_map_quality)[stratum];
-            else
-                std::cerr << "NL=" << NL << " stratum=" << stratum
-                    << " exceeds length of map_q" << std::endl;
-            if (pile[stratum].indel)
-                pile[stratum].indel->map_q = pile[stratum].map_q;
-        }
-
-        if (pile[stratum].read_map_q and pile[stratum].map_q
-            and pile[stratum].map_q != pile[stratum].read_map_q) {
-            std::cerr << "NL=" << NL << " stratum=" << stratum
-                << " read_map_q != map_q: " << pile[stratum].read_map_q
-                << " vs " << pile[stratum].map_q << std::endl;
-        }
+            count_sampled_out<Policy>(st, stratum - sample_start, base_quality,
+                                      map_quality, sample_map_q, base_q_offset);
 
         ++stratum;
         ++i;
     }
 
+    }  // samples
+
     if (debug(2))
-        std::cerr << thisfunc << ": line " << NL << " has " << stratum << " strata" << std::endl;
-
-    update_qualities_seen();
-    //if (min_base_quality)
-    //    pileup.set_min_base_quality(min_base_quality);
-    //if (min_map_quality)
-    //    pileup.set_min_map_quality(min_map_quality);
-
-    if (pile.size() != stratum) {
-        std::cerr << "at end of parse_line, pile.size() " << pile.size() << " != stratum "
-            << stratum << std::endl;
-        if (pile.size() > stratum)
-            std::cerr << "MAJOR PROBLEM: shrinking the size of the pile!!!!!!" << std::endl;
-        pile.resize(stratum);
+        std::cerr << "parse_pile: line " << NL << " has " << stratum << " strata" << std::endl;
+
+    pileup.min_set_base_quality = base_q_offset;
+    pileup.min_set_map_quality = min_map_quality;
+
+    stats.strata += stratum;
+    stats.peak_pile = std::max(stats.peak_pile, stratum);
+    stats.peak_read_stack = std::max(stats.peak_read_stack, read_stack.size() + n_ended);
+
+    if (sampling) {
+        ++stats.sampled_lines;
+        stats.sampled_strata += n_sampled_out;
+    }
+    if (stratum > pile.size() + n_sampled_out) {
+        ++stats.capped_lines;
+        stats.capped_strata += stratum - pile.size() - n_sampled_out;
+    }
+    if (stratum != size_t(pileup.cov)) {
+        const int d = stratum > size_t(pileup.cov)
+                          ? Diagnostics::D_pile_grown : Diagnostics::D_pile_short;
+        if (diagnostics.count(d))
+            diagnostics.example(d, NL, stratum, "coverage " + std::to_string(pileup.cov));
     }
 
     pileup.parse_state = static_cast<Pileup::parsestate_t>(pileup.parse_state | Pileup::PS_pile);
@@ -338,47 +706,221 @@ PileupParser::parse_pile()
 }
 
 
-//----------------- other stuff
+// Choose the parse_pile_policy<> instantiation used by parse_pile() once, up
+// front.  The input decides whether there are -s columns (has_map_q) and the
+// base quality offset; the caller decides whether the ReadStack is kept up
+// (track_reads, needed by read_end_hook) and whether indels are kept in
+// pileup.indels.  Indels and read boundaries are parsed past either way.
 
+template<bool M, bool R, bool I> void
+PileupParser::select_parse_policy_offset()
+{
+    if (min_base_quality == 33)
+        parse_pile_fn = &PileupParser::parse_pile_policy< ParsePolicy<M, R, I, 33> >;
+    else if (min_base_quality == 64)
+        parse_pile_fn = &PileupParser::parse_pile_policy< ParsePolicy<M, R, I, 64> >;
+    else
+        parse_pile_fn = &PileupParser::parse_pile_policy< ParsePolicy<M, R, I, 0> >;
+}
 
 void
-PileupParser::scan(size_t n_lines)
+PileupParser::select_parse_policy(const bool track_reads, const bool keep_indels)
 {
-    // scan the input pileup and do a quick summary of what is seen
-    // default to say 1000 lines, on option do more up to whole file
+    const int p = (has_map_q ? 4 : 0) + (track_reads ? 2 : 0) + (keep_indels ? 1 : 0);
+    switch (p) {
+        case 7: select_parse_policy_offset<true,  true,  true >(); break;
+        case 6: select_parse_policy_offset<true,  true,  false>(); break;
+        case 5: select_parse_policy_offset<true,  false, true >(); break;
+        case 4: select_parse_policy_offset<true,  false, false>(); break;
+        case 3: select_parse_policy_offset<false, true,  true >(); break;
+        case 2: select_parse_policy_offset<false, true,  false>(); break;
+        case 1: select_parse_policy_offset<false, false, true >(); break;
+        case 0: select_parse_policy_offset<false, false, false>(); break;
+    }
 }
 
+// Set up the parser before the first line.  The layout is learned before
+// the parse policy is chosen, since it decides whether reads are tracked
+// for mapping qualities.
 
 void
-PileupParser::update_qualities_seen()
-{
-    uchar_t prev_min_bq = min_base_quality_seen, prev_max_bq = max_base_quality_seen,
-            prev_min_mq = min_map_quality_seen, prev_max_mq = max_map_quality_seen;
-    if (pileup.cov == 0) return;
-    for (size_t i = 0; i < pileup.pile.size(); ++i) {
-        if (pileup.pile[i].base_q < min_base_quality_seen)
-            min_base_quality_seen = pileup.pile[i].base_q;
-        else if (pileup.pile[i].base_q > max_base_quality_seen)
-            max_base_quality_seen = pileup.pile[i].base_q;
-        if (pileup.pile[i].map_q < min_map_quality_seen)
-            min_map_quality_seen = pileup.pile[i].map_q;
-        else if (pileup.pile[i].map_q > max_map_quality_seen)
-            max_map_quality_seen = pileup.pile[i].map_q;
+PileupParser::configure(const ParserConfig& config)
+{
+    min_base_quality = config.base_quality_offset;
+    min_map_quality = config.map_quality_offset;
+    has_map_q = config.has_map_q;
+    base_quality_threshold = config.base_quality_threshold;
+    map_quality_threshold = config.map_quality_threshold;
+    max_pile_depth = config.max_pile_depth;
+    max_depth = config.max_depth;
+    read_end_hook = config.read_end_hook;
+    line_source = config.line_source;
+    if (config.learn_layout)
+        learn_layout();
+    select_parse_policy(config.track_reads or (config.map_q_from_reads and ! has_map_q),
+                        config.keep_indels);
+}
+
+
+//----------------- other stuff
+
+
+// split a line into fields, reusing the strings already in f
+static int
+split_fields(const std::string& line, const char FS, std::vector<std::string>& f)
+{
+    size_t pos = 0, n = 0;
+    while (true) {
+        if (n == f.size()) f.resize(n + 1);
+        size_t t = line.find(FS, pos);
+        f[n++].assign(line, pos, (t == std::string::npos) ? std::string::npos : t - pos);
+        if (t == std::string::npos) break;
+        pos = t + 1;
+    }
+    return(int(n));
+}
+
+// do the columns following ref, pos and refbase look like n samples, each
+// with per_sample columns: cov, base call, base quality and maybe map quality?
+static bool
+valid_sample_columns(const std::vector<std::string>& f, const int nf, const int per_sample)
+{
+    if (nf <= PileupParser::F_cov or (nf - PileupParser::F_cov) % per_sample != 0)
+        return false;
+    for (int c = PileupParser::F_cov; c < nf; c += per_sample) {
+        const std::string& cov_field = f[c];
+        if (cov_field.empty() or cov_field.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        const size_t cov = atol(cov_field.c_str());
+        if (cov == 0)
+            continue;
+        if (f[c + 2].length() != cov)
+            return false;
+        if (per_sample == 4 and f[c + 3].length() != cov)
+            return false;
+    }
+    return true;
+}
+
+bool
+PileupParser::scan(size_t n_lines, size_t n_offsets)
+{
+    // Scan a sample of the input pileup and do a quick summary of what is
+    // seen: lines are read from n_offsets evenly-spaced places in the file,
+    // so the input must be seekable.  The scan fills in scanned() and leaves
+    // the stream back at the start of the file; it does not configure the
+    // parser, that is left to configure().
+    const char* const thisfunc = "scan";
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    last_scan = PileupScan();
+    if (! stream.is_open() or NL > 0) return false;
+    stream.seekg(0, std::ios::end);
+    const std::streamoff size = stream.tellg();
+    if (size <= 0) {  // not seekable, nothing has been consumed
+        stream.clear();
+        return false;
+    }
+    if (n_offsets == 0) n_offsets = 1;
+    const size_t lines_per_offset = std::max(size_t(1), n_lines / n_offsets);
+
+    std::vector<std::string> sample;
+    std::string l;
+    sample.reserve(n_lines);
+    std::streamoff sampled_to = 0;  // end of the lines sampled so far
+    for (size_t o = 0; o < n_offsets; ++o) {
+        std::streamoff off = (size / std::streamoff(n_offsets)) * std::streamoff(o);
+        stream.clear();
+        if (off < sampled_to) {  // small file, carry on from the last line sampled
+            if (sampled_to >= size) break;
+            stream.seekg(sampled_to, std::ios::beg);
+        } else {
+            stream.seekg(off, std::ios::beg);
+            if (off > 0) getline(stream, l, RS);  // partial line
+        }
+        size_t got = 0;
+        for (; got < lines_per_offset and getline(stream, l, RS); ++got)
+            if (! l.empty()) sample.push_back(l);
+        if (got) ++last_scan.offsets;
+        stream.clear();
+        sampled_to = stream.tellg();
+    }
+    stream.clear();
+    stream.seekg(0, std::ios::beg);
+    last_scan.lines = sample.size();
+    if (sample.empty()) return false;
+
+    // which column layout fits every line sampled, -s or not?
+    std::vector<std::string> f;
+    bool fits_map_q = true, fits_no_map_q = true;
+    for (size_t i = 0; i < sample.size(); ++i) {
+        const int nf = split_fields(sample[i], FS, f);
+        fits_map_q = fits_map_q and valid_sample_columns(f, nf, F_END - F_cov);
+        fits_no_map_q = fits_no_map_q and valid_sample_columns(f, nf, F_END - F_cov - 1);
     }
-    if (debug(2)) {
-        if (prev_min_bq > min_base_quality_seen)
-            std::cerr << "NL=" << NL << " min_base_quality_seen = " << min_base_quality_seen
-                << ":" << uint16_t(min_base_quality_seen) << std::endl;
-        if (prev_max_bq > max_base_quality_seen)
-            std::cerr << "NL=" << NL << " max_base_quality_seen = " << max_base_quality_seen
-                << ":" << uint16_t(max_base_quality_seen) << std::endl;
-        if (prev_min_mq > min_map_quality_seen)
-            std::cerr << "NL=" << NL << " min_map_quality_seen = " << min_map_quality_seen
-                << ":" << uint16_t(min_map_quality_seen) << std::endl;
-        if (prev_max_mq > max_map_quality_seen)
-            std::cerr << "NL=" << NL << " max_map_quality_seen = " << max_map_quality_seen
-                << ":" << uint16_t(max_map_quality_seen) << std::endl;
+    if (! fits_map_q and ! fits_no_map_q)
+        std::cerr << thisfunc << ": sampled lines do not have a consistent column layout" << std::endl;
+    last_scan.has_map_q = fits_map_q or ! fits_no_map_q;
+    const int per_sample = last_scan.has_map_q ? (F_END - F_cov) : (F_END - F_cov - 1);
+
+    // base qualities, and whether sampled lines appear in sorted order;
+    // samples are in file order so one running check covers them all
+    size_t n_qual = 0, n_low = 0, n_high = 0;
+    std::vector<std::string> refs_seen;
+    std::string last_ref;
+    size_t last_pos = 0;
+    for (size_t i = 0; i < sample.size(); ++i) {
+        const int nf = split_fields(sample[i], FS, f);
+        if (i == 0) last_scan.n_samples = (nf - F_cov) / per_sample;
+        const size_t p = atol(f[F_pos].c_str());
+        if (f[F_ref] == last_ref) {
+            if (p <= last_pos) last_scan.sorted = false;
+        } else {
+            if (std::find(refs_seen.begin(), refs_seen.end(), f[F_ref]) != refs_seen.end())
+                last_scan.sorted = false;
+            refs_seen.push_back(f[F_ref]);
+            last_ref = f[F_ref];
+        }
+        last_pos = p;
+        for (int c = F_cov; c + 2 < nf; c += per_sample) {
+            if (atol(f[c].c_str()) == 0) continue;
+            const std::string& q = f[c + 2];
+            kernels().min_max(q.data(), q.length(),
+                              last_scan.min_base_quality_seen, last_scan.max_base_quality_seen);
+            const size_t n_ok = kernels().count_at_least(q.data(), q.length(), ';');
+            n_low += q.length() - n_ok;  // below Phred+64 range, bar N
+            n_high += kernels().count_at_least(q.data(), q.length(), 'O' + 1);  // above Q46 in Phred+33
+            n_qual += q.length();
+        }
     }
+    // Phred+64 data can still hold low characters near Ns (see TODO above),
+    // so go with whichever range is better supported
+    last_scan.base_quality_offset = (n_high > n_low) ? 64 : 33;
+    last_scan.done = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    last_scan.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    if (debug(1)) last_scan.print(std::cerr);
+    return true;
+}
+
+// Input that cannot be scanned, such as stdin or a pipe, has its layout
+// taken from its first line instead, by the same test as scan(); has_map_q
+// is left as it is if the line fits both layouts or neither.  The line is
+// read ahead and given again by the next read_line().
+
+bool
+PileupParser::learn_layout()
+{
+    if (! read_line())
+        return(false);
+    const bool fits_map_q = valid_sample_columns(fields, NF, F_END - F_cov);
+    const bool fits_no_map_q = valid_sample_columns(fields, NF, F_END - F_cov - 1);
+    if (fits_map_q != fits_no_map_q)
+        has_map_q = fits_map_q;
+    line_pending = true;
+    return(true);
 }
 
 
@@ -420,6 +962,220 @@ operator<<(std::ostream&os, const PileupParser& parser)
 }
 
 
+//--------------------------------------------------------
+//--------------------------------- memory accounting
+
+const char* const MemoryUsage::names[MemoryUsage::M_END] = {
+    "line", "read_stack", "pile", "indels", "references", "reports"
+};
+
+static inline size_t
+stringBytes(const std::string& s)
+{
+    return(sizeof(std::string) + s.capacity());
+}
+
+// Bytes held by the parser's containers.  references grows with the number
+// of contigs, the others with the deepest and longest line seen.
+
+void
+PileupParser::memory_usage(MemoryUsage& mem) const
+{
+    size_t b = stringBytes(line);
+    for (size_t f = 0; f < fields.size(); ++f)
+        b += stringBytes(fields[f]);
+    mem.bytes[MemoryUsage::M_line] = b;
+    mem.bytes[MemoryUsage::M_read_stack] = read_stack.capacity() * sizeof(Read);
+    mem.bytes[MemoryUsage::M_pile] = pileup.pile.capacity() * sizeof(Stratum);
+    mem.bytes[MemoryUsage::M_indels] = pileup.indels.capacity() * sizeof(Indel)
+                                       + pileup.arena.capacity();
+    b = reference_hashes.size() * (sizeof(uint64_t) + 2 * sizeof(void*))
+        + reference_hashes.bucket_count() * sizeof(void*);
+    for (size_t r = 0; r < references.size(); ++r)
+        b += stringBytes(references[r]);
+    mem.bytes[MemoryUsage::M_references] = b;
+}
+
+// Give back capacity beyond what the current line needs, as left behind by
+// an earlier deep or long line.  Pile and indel contents are not kept, so
+// call this between lines.
+
+void
+PileupParser::release_memory()
+{
+    line.shrink_to_fit();
+    for (size_t f = 0; f < fields.size(); ++f)
+        fields[f].shrink_to_fit();
+    read_stack.shrink_to_fit();
+    pileup.pile.clear();
+    pileup.pile.shrink_to_fit();
+    pileup.indels.clear();
+    pileup.indels.shrink_to_fit();
+    pileup.arena.release();
+    forget_references();
+}
+
+// Only the current reference is needed to follow the input, the rest are
+// history; n_references still counts them all.
+
+void
+PileupParser::forget_references()
+{
+    if (references.size() > 1) {
+        references.erase(references.begin(), references.end() - 1);
+        references.shrink_to_fit();
+    }
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class Diagnostics
+
+// Counts of each class of problem in the input, with the first n_examples
+// of each, see Diagnostics in the header
+
+const char* const Diagnostics::names[Diagnostics::D_END] = {
+    "fields", "pile_grown", "pile_short", "base_q_short", "map_q_short",
+    "read_map_q", "unknown_base_call", "malformed_indel", "reads_unended", "reads_unstarted", "unsorted"
+};
+
+const char* const Diagnostics::descriptions[Diagnostics::D_END] = {
+    "lines with fields that are not a whole number of samples",
+    "lines with more strata than the coverage column",
+    "lines with fewer strata than the coverage column",
+    "strata beyond the end of the base quality column",
+    "strata beyond the end of the mapping quality column",
+    "read starts whose mapping quality differs from the -s column",
+    "unknown base call characters, skipped or kept in indels",
+    "indels longer than the rest of the base call column, cut short",
+    "reads still open at the end of a contig, dropped",
+    "reads already open where the input begins, not reported and without -s taken as mapping quality 0",
+    "lines out of sorted order, revisiting a contig or not after the position before"
+};
+
+Diagnostics::Diagnostics(const size_t n_ex)
+    : n_examples(n_ex)
+{
+    for (int d = 0; d < D_END; ++d)
+        counts[d] = 0;
+}
+
+Diagnostics::~Diagnostics()
+{ }
+
+void
+Diagnostics::example(const int d, const size_t line, const size_t stratum,
+                     const std::string& detail)
+{
+    Example e;
+    e.line = line;
+    e.stratum = stratum;
+    e.detail = detail;
+    examples[d].push_back(e);
+}
+
+uint64_t
+Diagnostics::total() const
+{
+    uint64_t t = 0;
+    for (int d = 0; d < D_END; ++d)
+        t += counts[d];
+    return(t);
+}
+
+void
+Diagnostics::print(std::ostream& os, const std::string& prefix) const
+{
+    for (int d = 0; d < D_END; ++d) {
+        if (! counts[d]) continue;
+        os << prefix << counts[d] << " " << descriptions[d];
+        for (size_t i = 0; i < examples[d].size(); ++i)
+            os << (i ? "; " : ", first at ") << "line " << examples[d][i].line
+                << " stratum " << examples[d][i].stratum << " (" << examples[d][i].detail << ")";
+        os << std::endl;
+    }
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class ParserStats
+
+// Counters and stage timers kept by PileupParser, see ParserStats in the header
+//
+// peak_read_stack      : most reads covering one position, counting reads
+//                        that end there; 0 unless reads are tracked
+// peak_pile            : most strata at one position
+
+ParserStats::ParserStats()
+    : timing(false), bytes(0), strata(0), indels(0), read_starts(0), read_ends(0),
+      peak_read_stack(0), peak_pile(0), capped_lines(0), capped_strata(0),
+      sampled_lines(0), sampled_strata(0)
+{ }
+
+ParserStats::~ParserStats()
+{ }
+
+
+//--------------------------------------------------------
+//--------------------------------- class ParserConfig
+
+// Defaults are those of samtools pileup output that could not be scanned,
+// with every stratum kept and the read stack and indels kept up
+
+ParserConfig::ParserConfig()
+    : base_quality_offset(33), map_quality_offset(33), has_map_q(true), learn_layout(false),
+      base_quality_threshold(0), map_quality_threshold(0), max_pile_depth(0), max_depth(0),
+      track_reads(true), map_q_from_reads(false), keep_indels(true), read_end_hook(0),
+      line_source(0)
+{ }
+
+void
+ParserConfig::set_layout(const PileupScan& scan)
+{
+    base_quality_offset = scan.base_quality_offset;
+    map_quality_offset = scan.map_quality_offset;
+    has_map_q = scan.has_map_q;
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class PileupScan
+
+// Summary of a sample of lines from a pileup file, see PileupParser::scan()
+//
+// done                 : true if the scan was completed
+// lines                : number of lines sampled
+// offsets              : number of places in the file lines were sampled from
+// n_samples            : samples per line
+// has_map_q            : lines have -s mapping quality columns
+// base_quality_offset  : 33 or 64, whichever range fits the base qualities best
+// map_quality_offset   : always 33 for samtools
+// min/max_base_quality_seen : raw range of base quality characters
+// sorted               : false if any sampled lines were out of order
+// seconds              : wall time taken by the scan
+
+PileupScan::PileupScan()
+    : done(false), lines(0), offsets(0), n_samples(0), has_map_q(true),
+      base_quality_offset(33), map_quality_offset(33),
+      min_base_quality_seen(0xff), max_base_quality_seen(0x00),
+      sorted(true), seconds(0)
+{ }
+
+PileupScan::~PileupScan()
+{ }
+
+void
+PileupScan::print(std::ostream& os) const
+{
+    os << "scan: " << (done ? "" : "not done, ") << lines << " lines from " << offsets
+        << " offsets in " << seconds << " s: " << n_samples << " sample(s), "
+        << (has_map_q ? "with" : "without") << " -s mapping quality, base quality Phred+"
+        << uint16_t(base_quality_offset) << " (seen " << uint16_t(min_base_quality_seen)
+        << "-" << uint16_t(max_base_quality_seen) << "), "
+        << (sorted ? "sorted" : "NOT sorted") << std::endl;
+}
+
+
 //--------------------------------------------------------
 //--------------------------------- class Pileup
 
@@ -431,20 +1187,34 @@ operator<<(std::ostream&os, const PileupParser& parser)
 // raw_base_call    : pointer to *unparsed* fields[4] member for base calls
 // raw_base_quality : pointer to *unparsed* fields[5] member for base quality
 // raw_map_quality  : pointer to *unparsed* fields[6] member for mapping quality
+// n_samples        : number of samples (sets of cov/call/quality columns) on the line
+// sample_*         : per-sample coverage and pointers to unparsed fields, raw_*
+//                    above are the same as sample_*[0]
 // pile             : vector of Stratum, describing each read contribution
 // indels           : vector of Indel, describing each declared indel
 // parse_state      : PS_NONE, PS_lite, PS_pile, PS_all (== PS_lite | PS_pile),
 //                    tells when the line has been read and the pileup has been
 //                    parsed
-// min_set_base_quality : set by user
-// min_set_map_quality  : set by user, defaults to samtools +33
+// min_set_base_quality : offset removed from base qualities in the pile
+// min_set_map_quality  : offset removed from mapping qualities in the pile,
+//                        defaults to samtools +33
+// hq_cov           : strata passing the parser's base and mapping quality
+//                    thresholds, counted while parsing, whether or not they
+//                    are kept in the pile
+// sample_hq_cov    : hq_cov for each sample
+// hq_base_count    : A, C, G, T, N among hq_cov strata kept by max_depth
+//                    sampling, indexed by B_A etc.
 
 Pileup::Pileup(uchar_t min_base_qual)
     : ref(""), pos(0), refbase('\0'), cov(-1),
       raw_base_call(0), raw_base_quality(0), raw_map_quality(0),
+      n_samples(0),
       parse_state(PS_NONE),
-      min_set_base_quality(min_base_qual), min_set_map_quality(33)
-{ }
+      min_set_base_quality(min_base_qual), min_set_map_quality(33),
+      hq_cov(0)
+{
+    std::fill(hq_base_count, hq_base_count + B_END, 0);
+}
 
 
 Pileup::~Pileup()
@@ -455,8 +1225,13 @@ void
 Pileup::reset_pile()
 {
     // should never affect anything set by parse_line_lite()
+    // clear() keeps capacity, so once warmed up this does not allocate
     pile.clear();
     indels.clear();
+    arena.reset();
+    hq_cov = 0;
+    sample_hq_cov.assign(n_samples, 0);
+    std::fill(hq_base_count, hq_base_count + B_END, 0);
 }
 
 
@@ -470,17 +1245,44 @@ Pileup::base_count()
 }
 
 
+void
+Pileup::count_bases(uint32_t counts[B_END]) const
+{
+    // like base_count(), without a map
+    std::fill(counts, counts + B_END, 0);
+    for (Pile::const_iterator citer = pile.begin(); citer != pile.end(); ++citer) {
+        const int b = baseIndex(citer->base);
+        if (b >= 0) ++counts[b];
+    }
+}
+
+
+BaseCount
+Pileup::base_count(const int16_t sample)
+{
+    BaseCount ans;
+    for (Pile::const_iterator citer = pile.begin(); citer != pile.end(); ++citer)
+        if (citer->sample == sample)
+            ++ans[citer->base];
+    return(ans);
+}
+
+
+// Qualities in the pile already have min_set_*_quality removed during
+// parsing; these change the offset removed, e.g. to correct a guess
+
 bool
 Pileup::set_min_base_quality(uchar_t min_base_q)
 {
-    if (min_base_q == 0)
-        std::cerr << "pileup::set_min_base_quality: argument is 0, so a no-op" << std::endl;
+    if (min_base_q == min_set_base_quality)
+        return true;
     bool good_quals = true;
+    const int delta = int(min_base_q) - int(min_set_base_quality);
     min_set_base_quality = min_base_q;
     for (Pile::iterator iter = pile.begin(); iter != pile.end(); ++iter) {
-        if (iter->base_q < min_base_q)
+        if (int(iter->base_q) < delta)
             good_quals = false;
-        iter->base_q -= min_base_q;
+        iter->base_q = uchar_t(std::max(0, int(iter->base_q) - delta));
     }
     return good_quals;
 }
@@ -489,16 +1291,16 @@ Pileup::set_min_base_quality(uchar_t min_base_q)
 bool
 Pileup::set_min_map_quality(uchar_t min_map_q)
 {
-    if (min_map_q == 0)
-        std::cerr << "pileup::set_min_base_quality: argument is 0, so a no-op" << std::endl;
+    if (min_map_q == min_set_map_quality)
+        return true;
     bool good_quals = true;
+    const int delta = int(min_map_q) - int(min_set_map_quality);
     min_set_map_quality = min_map_q;
     for (Pile::iterator iter = pile.begin(); iter != pile.end(); ++iter) {
-        if (iter->map_q < min_map_q or iter->read_map_q < min_map_q)
+        if (int(iter->map_q) < delta or int(iter->read_map_q) < delta)
             good_quals = false;
-        iter->map_q -= min_map_q;
-        if (iter->read_map_q)
-            iter->read_map_q -= min_map_q;
+        iter->map_q = uchar_t(std::max(0, int(iter->map_q) - delta));
+        iter->read_map_q = uchar_t(std::max(0, int(iter->read_map_q) - delta));
     }
     return good_quals;
 }
@@ -548,9 +1350,9 @@ Pileup::print_pile_stack(std::ostream& os, const size_t start, size_t end,
                 pile[i].indel->print_compact(os);
         }
         os << end_stack;
-        for (i = start; i <= end; ++i) os << pile[i].base_q;
+        for (i = start; i <= end; ++i) os << uchar_t(pile[i].base_q + min_set_base_quality);
         os << end_stack;
-        for (i = start; i <= end; ++i) os << pile[i].map_q;
+        for (i = start; i <= end; ++i) os << uchar_t(pile[i].map_q + min_set_map_quality);
         os << end_stack;
         os.flush();
     }
@@ -597,16 +1399,17 @@ operator<<(std::ostream& os, const Pileup& pileup)
 // One stratum per read per position
 //
 // base        : the base declared in this stratum
-// base_q      : base quality, scale must be set by user (TODO: guess quality, tell user if they're wrong)
-// map_q       : mapping quality, samtools convention is Phred+33s (TODO: guess quality, & other mappers?)
+// base_q      : base quality, offset removed, see Pileup::min_set_base_quality
+// map_q       : mapping quality, offset removed, samtools convention is Phred+33 (TODO: other mappers?)
 // dir         : RD_NONE, RD_fwd, RD_rev (enum typedef in PileupTools namespace)
 // read_str    : read structure, RS_NONE, RS_start, RS_end, RS_gap (enum typedef in PileupTools namespace)
-// read_map_q  : mapping quality, samtools convention is Phred+33s (TODO: other mappers?)
+// read_map_q  : mapping quality from the ^q read start, offset removed as for map_q
+// sample      : sample (set of pileup columns) the stratum came from
 // indel       : pointer to class Indel instance if there's an indel declared here
 
 Stratum::Stratum()
     : base('\0'), base_q('\0'), map_q('\0'), dir(RD_NONE), read_str(RS_NONE),
-      read_map_q('\0'), indel(0)
+      read_map_q('\0'), sample(0), indel(0)
 { }
 
 Stratum::~Stratum()
@@ -623,20 +1426,30 @@ Stratum::~Stratum()
 // type     : IN_NONE, IN_ins, IN_del (enum typedef in PileupTools namespace)
 // dir      : RD_NONE, RD_fwd, RD_rev (enum typedef in PileupTools namespace)
 // size     : signed, with + = insertion, - = deletion (yes, the sign is redundant to type)
-// seq      : the uppercase sequence of the indel
+// seq      : the uppercase sequence of the indel, held in the Pileup's arena so
+//            it is only valid until the next line is parsed
 // stratum  : the read stratum in which the Indel was declared
 // map_q    : mapping quality of the read declaring the indel
 //
 // TODO: anything else to note for an indel?
 
-Indel::Indel(const int32_t sz, const std::string& sq, const size_t strat, const uchar_t mq)
+Indel::Indel(const int32_t sz, const char* sq, const readdir_t d, ByteArena& arena,
+             const size_t strat, const uchar_t mq)
     : type(sz > 0 ? IN_ins : IN_del),
-      dir(isBaseForward(sq[0]) ? RD_fwd : RD_rev),
+      dir(d),
       size(sz),
-      seq(dir == RD_fwd ? sq : toUpper(sq)),
+      seq(0),
       stratum(strat),
       map_q(mq)
-{ }
+{
+    // sq is abs(sz) characters within the base call column, copied uppercase;
+    // the parser cuts sz short if the column ends sooner
+    const size_t len = abs(sz);
+    char* s = arena.alloc(len + 1);
+    for (size_t i = 0; i < len; ++i) s[i] = toupper(sq[i]);
+    s[len] = '\0';
+    seq = s;
+}
 
 
 Indel::Indel()
@@ -683,29 +1496,82 @@ const std::string
 Indel::seq_qualified() const
 {
     std::ostringstream qseq;
-    qseq << (type > IN_ins ? "+" : "-") << (dir == RD_rev ? toLower(seq) : seq);
+    qseq << (type > IN_ins ? "+" : "-") << (dir == RD_rev ? toLower(seq) : std::string(seq));
     return(qseq.str());
 }
 
-//
+//--------------------------------------------------------
+//--------------------------------- class ByteArena
+
+// blocks     : blocks of bytes, each at least block_size
+// block_size : size of new blocks, unless a larger allocation needs more
+// block      : index of the block currently being filled
+// used       : bytes already handed out from that block
+
+ByteArena::ByteArena(const size_t block_sz)
+    : block_size(block_sz), block(0), used(0)
+{ }
+
+ByteArena::~ByteArena()
+{ }
+
+char *
+ByteArena::alloc(const size_t n)
+{
+    while (block < blocks.size() and used + n > blocks[block].size()) {
+        ++block;
+        used = 0;
+    }
+    if (block == blocks.size())
+        blocks.push_back(std::vector<char>(std::max(block_size, n)));
+    char* ans = &blocks[block][used];
+    used += n;
+    return(ans);
+}
+
+void
+ByteArena::release()
+{
+    reset();
+    if (blocks.size() > 1) {
+        blocks.resize(1);
+        blocks.shrink_to_fit();
+    }
+}
+
+size_t
+ByteArena::capacity() const
+{
+    size_t ans = 0;
+    for (size_t b = 0; b < blocks.size(); ++b) ans += blocks[b].size();
+    return(ans);
+}
+
+
 //--------------------------------------------------------
 //--------------------------------- class Read
 
 // This holds an instance of a read description.  These are instantiated
 // as we see read starts in the input pileup, and a ReadStack of these,
 // as variable read_stack in the PileupParser class, tracks reads for all
-// strata.  ReadStack is currently a deque, this may be replaced if this
-// is too inefficient.
+// strata.  ReadStack is a vector, which unlike a deque keeps its capacity
+// as reads are inserted and erased, so it stops allocating once it has
+// grown to the deepest pile.
 //
 // stratum  : the read stratum which the read provides
 // start_pos : the starting position at which the read was declared to begin
 // end_pos  : the *open* ending position at which the read was declared to end
 // aligned_length : end_pos - start_pos
-// map_q    : mapping quality of the read as declared at read start
+// map_q    : mapping quality of the read as declared at read start, offset removed
 // dir      : RD_NONE, RD_fwd, RD_rev as declared at read start
 // bp_gap   : bp of gaps encountered along this read (updated as pileup is read)
 // bp_insert : bp of insertions encountered along this read (updated as pileup is read)
 // sample   : sample in pileup to which this read belongs
+// key      : set at read start when sampling under PileupParser::max_depth
+// sampled_out : some stratum of the read was sampled out, so it is not passed
+//               to the ReadEndHook
+// unstarted : a placeholder for a read open where the input begins, with no
+//             known start or mapping quality, also not passed to the ReadEndHook
 //
 
 Read::Read(const size_t strat, const size_t p, const uchar_t mq, const readdir_t d,
@@ -719,6 +1585,9 @@ Read::Read(const size_t strat, const size_t p, const uchar_t mq, const readdir_t
       bp_gap(0),
       bp_insert(0),
       sample(samp),
+      key(0),
+      sampled_out(false),
+      unstarted(false),
       debug_level(dbg)
 {
     if (debug(1)) std::cerr << "Read :: Read(...) " << (*this) << std::endl;
@@ -727,7 +1596,8 @@ Read::Read(const size_t strat, const size_t p, const uchar_t mq, const readdir_t
 
 Read::Read()
     : stratum(0), start_pos(0), end_pos(0), aligned_length(0), map_q(0), dir(RD_NONE),
-      bp_gap(0), bp_insert(0), sample(0), debug_level(0)
+      bp_gap(0), bp_insert(0), sample(0), key(0), sampled_out(false),
+      unstarted(false), debug_level(0)
 {
     if (debug(1)) std::cerr << "Read :: Read() " << (*this) << std::endl;
 }
@@ -5,12 +5,11 @@
 // Some definitions that are used by the class are provided in the namespace
 // outside the class.
 //
+// Without samtools -s columns, each stratum takes the mapping quality of its
+// read from the ^q digraph at the read start, carried on the ReadStack.  When
+// a read in the middle of the pile ends, the reads above it drop down one.
+//
 // TODO:
-// --- implement non-samtools -s dependent read qualities by maintaining a
-//     pile-high stack of current read mapping qualities from the base call
-//     ^q digraphs... a few questions here... easy to build up stack but when
-//     a read in the middle of the pile ends, do all overhead reads drop
-//     down one read?  They must...
 // --- sort out namespace issues.  this is too messy as it is.
 // --- similarly sort out enum scoping and find best practices for providing
 //     types associated with a class... BamTools does a pretty darn nice job
@@ -38,6 +37,7 @@
 #include <sstream>
 #include <iomanip>
 #include <map>
+#include <unordered_set>
 #include <vector>
 #include <string>
 #include <memory>
@@ -45,13 +45,14 @@
 #include <algorithm>
 #include <ctype.h>
 #include <stdint.h>
-
-// read stack
-#include <deque>
+#include <time.h>
+#include <chrono>
 
 // #define NDEBUG  // uncomment to remove assert() code
 #include <assert.h>
 
+namespace smorgas { class Analysis; }  // a friend of PileupParser
+
 namespace PileupTools {
 
 //--------------------- types and type-related utilities
@@ -122,6 +123,22 @@ inline bool isForward(uchar_t c) {
 
 //--------------------- utility variables and functions
 
+// raw quality character less its offset, never below 0
+inline uchar_t offsetQuality(uchar_t raw, uchar_t offset) {
+    return(raw > offset ? raw - offset : 0);
+}
+
+// order of bases in per-base count arrays
+enum { B_A=0, B_C, B_G, B_T, B_N, B_END };
+
+inline int baseIndex(uchar_t c) {
+    switch (c) {
+        case 'A': return B_A; case 'C': return B_C; case 'G': return B_G;
+        case 'T': return B_T; case 'N': return B_N;
+        default: return -1;
+    }
+}
+
 inline int32_t extractNumber(const std::string& s, size_t start, size_t& end) {
     // a bit like strtol() but with a crude check for overflow
     int32_t powers_of_10[] = {     1,      10,      100,      1000,      10000,
@@ -167,6 +184,32 @@ inline std::string toLower(const std::string &s) {
 }
 
 
+//---------------------------------------------------------------
+//--------------------- ByteArena class
+
+
+// Bump allocator for short-lived bytes, e.g. indel sequences for one line.
+// reset() forgets everything allocated but keeps the blocks, so once it has
+// grown to fit the largest line it no longer allocates.
+
+class ByteArena {
+public:
+    ByteArena(const size_t block_sz = 4096);
+    ~ByteArena();
+
+    char *                  alloc(const size_t n);
+    void                    reset() { block = 0; used = 0; }
+    void                    release();  // reset() and free all but the first block
+    size_t                  capacity() const;
+
+private:
+    std::vector<std::vector<char> > blocks;
+    size_t                  block_size;
+    size_t                  block;  // block currently being filled
+    size_t                  used;   // bytes used in that block
+};
+
+
 //---------------------------------------------------------------
 //--------------------- Read class and ReadStack container
 
@@ -191,6 +234,9 @@ public:
     int16_t                 bp_gap;     // bp of gaps in read
     int16_t                 bp_insert;  // bp of insertions in read
     int16_t                 sample;     // sample to which the read belongs (pileup column)
+    uint32_t                key;        // decides whether the read is kept under max_depth
+    bool                    sampled_out; // dropped at some position by max_depth
+    bool                    unstarted;  // open where the input begins, start unknown
 
     int                     debug_level;
     bool                    debug(int level) { return(debug_level >= level); }
@@ -205,7 +251,40 @@ public:
     friend std::ostream&    operator<<(std::ostream& os,
                                     const Read& read);
 };
-typedef std::deque<Read> ReadStack;
+typedef std::vector<Read> ReadStack;  // keeps its capacity as reads come and go
+
+
+//---------------------------------------------------------------
+//--------------------- ReadEndHook interface
+
+
+class Pileup;
+
+// Implemented by anything that wants to see each read as it closes.  The
+// parser calls read_end() when it sees '$', just before the Read is erased
+// from the ReadStack, so the Read is complete and pileup is at its last
+// position.  Keep read_end() O(1), it is called once per read.
+
+class ReadEndHook {
+public:
+    virtual ~ReadEndHook() { }
+    virtual void            read_end(const Read& read, const Pileup& pileup) = 0;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- LineSource interface
+
+
+// Implemented by anything that supplies pileup lines in place of the
+// parser's own stream, such as PileupMerge.  get_line() fills line, without
+// its line separator, and returns false when there are no more.
+
+class LineSource {
+public:
+    virtual ~LineSource() { }
+    virtual bool            get_line(std::string& line) = 0;
+};
 
 
 //---------------------------------------------------------------
@@ -215,7 +294,9 @@ typedef std::deque<Read> ReadStack;
 class Indel {
 public:
     Indel(const int32_t sz,
-            const std::string& sq,
+            const char* sq,
+            const readdir_t d,  // strand of the stratum it follows
+            ByteArena& arena,
             const size_t strat = 0,
             const uchar_t mq = 0);
     Indel();
@@ -225,7 +306,7 @@ public:
     indel_t                 type;
     readdir_t               dir;
     int32_t                 size;
-    std::string             seq;
+    const char *            seq;  // NUL-terminated, in the arena given to the ctor
     size_t                  stratum;
     uchar_t                 map_q;
 
@@ -255,6 +336,7 @@ public:
     readdir_t               dir;
     readstructure_t         read_str;  // TODO: infer read mapping quality from read structure
     uchar_t                 read_map_q;
+    int16_t                 sample;  // sample to which the stratum belongs (pileup column)
     Indel *                 indel;  // if an indel, points to an element of pileup.indels[]
 };
 typedef std::vector<Stratum> Pile;
@@ -279,9 +361,15 @@ public:
     const std::string *     raw_base_call;
     const std::string *     raw_base_quality;
     const std::string *     raw_map_quality;  // only set if -s flag passed to samtools
-    // TODO: multiple samples
+    // multiple samples: raw_* above point to sample 0, these hold all samples
+    int                     n_samples;
+    std::vector<int32_t>    sample_cov;
+    std::vector<const std::string *> sample_base_call;
+    std::vector<const std::string *> sample_base_quality;
+    std::vector<const std::string *> sample_map_quality;
     Pile                    pile;  // the pile has 1+ strata TODO: is 0 ever true?
     IndelVector             indels;  // less space to keep them here and not in Stratum
+    ByteArena               arena;   // holds indel sequences, reset with the pile
 
     enum parsestate_t { PS_NONE=0x0, PS_lite=0x1, PS_pile=0x2, PS_all=0x3 };
     parsestate_t            parse_state;
@@ -290,6 +378,11 @@ public:
     uchar_t                 min_set_base_quality;
     uchar_t                 min_set_map_quality;
 
+    // strata passing PileupParser quality thresholds, counted during parse
+    int32_t                 hq_cov;
+    std::vector<int32_t>    sample_hq_cov;
+    uint32_t                hq_base_count[B_END];
+
     bool                    set_min_base_quality(uchar_t min_base_q);
     bool                    set_min_map_quality(uchar_t min_map_q);
     std::vector<uchar_t>    get_map_q(const size_t start = 0,
@@ -297,6 +390,8 @@ public:
 
     void                    reset_pile();
     BaseCount               base_count();
+    BaseCount               base_count(const int16_t sample);
+    void                    count_bases(uint32_t counts[B_END]) const;
 
     void                    print(std::ostream& os = std::cerr) const;
     void                    print_pile(std::ostream& os = std::cerr,
@@ -319,10 +414,239 @@ public:
 };
 
 
+//---------------------------------------------------------------
+//--------------------- PileupScan class
+
+
+// What PileupParser::scan() learned from a sample of lines
+
+class PileupScan {
+public:
+    PileupScan();
+    ~PileupScan();
+
+    bool                    done;       // was a scan completed
+    size_t                  lines;      // lines sampled
+    size_t                  offsets;    // places in the file lines were sampled from
+    int                     n_samples;
+    bool                    has_map_q;  // -s mapping quality columns present
+    uchar_t                 base_quality_offset;  // 33 or 64
+    uchar_t                 map_quality_offset;   // 33 for samtools
+    uchar_t                 min_base_quality_seen;
+    uchar_t                 max_base_quality_seen;
+    bool                    sorted;     // sampled lines consistent with sorted input
+    double                  seconds;    // time taken by the scan
+
+    void                    print(std::ostream& os = std::cerr) const;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- StageTimer and ParserStats classes
+
+
+// Accumulates monotonic time spent in one stage.  lap() adds the time since
+// t and returns the current time, so that consecutive stages can be timed
+// with one clock read per boundary.
+
+class StageTimer {
+public:
+    StageTimer() : ns(0), calls(0) { }
+
+    uint64_t                ns;
+    uint64_t                calls;
+
+    static inline uint64_t  now() {
+                                return(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                       std::chrono::steady_clock::now().time_since_epoch()).count());
+                            }
+    inline uint64_t         lap(const uint64_t t) {
+                                const uint64_t t1 = now();
+                                ns += t1 - t;
+                                ++calls;
+                                return(t1);
+                            }
+    double                  seconds() const { return(ns * 1.0e-9); }
+};
+
+
+// What PileupParser has done so far.  The counters are always kept; the
+// timers only run if timing is set, so untimed runs pay nothing for them.
+// read_stack and read_end_hook time are spent within parse_pile, and do not
+// overlap.
+
+class ParserStats {
+public:
+    ParserStats();
+    ~ParserStats();
+
+    bool                    timing;
+    uint64_t                bytes;          // bytes read, including line separators
+    uint64_t                strata;
+    uint64_t                indels;
+    uint64_t                read_starts;
+    uint64_t                read_ends;
+    size_t                  peak_read_stack;
+    size_t                  peak_pile;
+    uint64_t                capped_lines;   // lines with more strata than max_pile_depth
+    uint64_t                capped_strata;  // strata parsed but not kept in the pile
+    uint64_t                sampled_lines;  // lines with cov beyond max_depth
+    uint64_t                sampled_strata; // strata sampled out of those lines
+    StageTimer              io;             // reading lines from the stream
+    StageTimer              tokenize;       // splitting lines into fields
+    StageTimer              parse_pile;
+    StageTimer              read_stack;     // read stack insertions and erasures
+    StageTimer              read_end_hook;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- Diagnostics class
+
+
+// Problems found in the input while parsing.  Each class of problem is
+// counted, and only the first n_examples of each keep an example, so bad
+// input costs an increment per problem rather than a write to stderr.
+// Call count() for every occurrence, and build and add an example only
+// when it returns true.
+
+class Diagnostics {
+public:
+    enum { D_fields,             // fields are not a whole number of samples
+           D_pile_grown,         // more strata than the coverage column
+           D_pile_short,         // fewer strata than the coverage column
+           D_base_q_short,       // base quality column shorter than the strata
+           D_map_q_short,        // mapping quality column shorter than the strata
+           D_read_map_q,         // read start mapping quality differs from -s
+           D_unknown_base_call,  // character outside the base call grammar, or a
+                                 // non-base in an indel sequence
+           D_malformed_indel,    // indel length beyond the end of the base call column
+           D_reads_unended,      // reads still open at the end of a contig
+           D_reads_unstarted,    // reads already open where the input begins
+           D_unsorted,           // line not after the one before in (contig, position)
+           D_END };
+    static const char* const names[D_END];
+    static const char* const descriptions[D_END];
+
+    class Example {
+    public:
+        size_t              line;
+        size_t              stratum;
+        std::string         detail;
+    };
+
+    Diagnostics(const size_t n_ex = 5);
+    ~Diagnostics();
+
+    size_t                  n_examples;
+    uint64_t                counts[D_END];
+    std::vector<Example>    examples[D_END];
+
+    inline bool             count(const int d) { return(++counts[d] <= n_examples); }
+    void                    example(const int d, const size_t line, const size_t stratum,
+                                    const std::string& detail);
+    uint64_t                total() const;
+    void                    print(std::ostream& os = std::cerr,
+                                  const std::string& prefix = "") const;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- MemoryUsage class
+
+
+// Bytes held by the growable containers behind parsing and reporting, by
+// capacity rather than size, since that is what is actually allocated.
+// PileupParser::memory_usage() fills all but M_reports, which is left to
+// whoever owns the report accumulators.
+
+class MemoryUsage {
+public:
+    enum { M_line,        // line and its fields
+           M_read_stack,
+           M_pile,
+           M_indels,      // Pileup::indels and the arena holding their sequences
+           M_references,  // contig names seen
+           M_reports,
+           M_END };
+    static const char* const names[M_END];
+
+    MemoryUsage() { for (int m = 0; m < M_END; ++m) bytes[m] = 0; }
+
+    size_t                  bytes[M_END];
+
+    size_t                  total() const {
+                                size_t t = 0;
+                                for (int m = 0; m < M_END; ++m) t += bytes[m];
+                                return(t);
+                            }
+};
+
+
+//---------------------------------------------------------------
+//--------------------- ParsePolicy template
+
+
+// Compile-time choices for PileupParser::parse_pile_policy<>()
+//
+// map_q               : the -s mapping quality columns are present
+// track_reads         : maintain the ReadStack and call the ReadEndHook; without
+//                       map_q, strata take their mapping quality from it
+// keep_indels         : build Indel entries in Pileup::indels
+// base_quality_offset : 33 or 64, or 0 to use PileupParser::min_base_quality
+
+template<bool MapQ, bool TrackReads, bool KeepIndels, int BaseQualityOffset>
+struct ParsePolicy {
+    static const bool       map_q = MapQ;
+    static const bool       track_reads = TrackReads;
+    static const bool       keep_indels = KeepIndels;
+    static const uchar_t    base_quality_offset = BaseQualityOffset;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- ParserConfig class
+
+
+// How a PileupParser reads its input, given to configure() before the first
+// line.  The encoding and layout are what scan() learns, copied by
+// set_layout(), or what is known of input that cannot be scanned; with
+// learn_layout, has_map_q is then taken from the first line if it tells.
+// track_reads and keep_indels choose the ParsePolicy, and map_q_from_reads
+// tracks reads too when there turn out to be no -s columns, so that strata
+// have mapping qualities.
+
+class ParserConfig {
+public:
+    ParserConfig();
+
+    uchar_t                 base_quality_offset;  // 33 or 64
+    uchar_t                 map_quality_offset;   // 33 for samtools
+    bool                    has_map_q;  // each sample has a -s mapping quality column
+    bool                    learn_layout;
+    uchar_t                 base_quality_threshold;  // for Pileup::hq_cov, after offset
+    uchar_t                 map_quality_threshold;
+    size_t                  max_pile_depth;   // 0 for none, or keep only this many strata
+    size_t                  max_depth;        // 0 for none, or sample strata down to about this many
+    bool                    track_reads;
+    bool                    map_q_from_reads;
+    bool                    keep_indels;
+    ReadEndHook *           read_end_hook;  // if set, sees each read as it ends
+    LineSource *            line_source;    // if set, lines come from here, not stream
+
+    void                    set_layout(const PileupScan& scan);
+};
+
+
 //---------------------------------------------------------------
 //--------------------- PileupParser class
 
 
+// The parser's state is its own; it is set up through configure(), and
+// what it finds is in pileup, diagnostics and stats.  smorgas::Analysis,
+// which drives it for the library and the smorgas command, also adjusts
+// it while running, under --max-memory.
+
 class PileupParser {
 
 public:
@@ -332,33 +656,14 @@ public:
     static const std::string contact() { return "douglasgscofield@gmail.com"; }
 
 public:
-    std::ifstream           stream;  // stream we're reading from
-    std::string             filename; // filename, if one was given
-    const char              FS;      // input field separator
-    const char              RS;      // input line separator
-    size_t                  NL;      // line number within pileup file
-    int                     NF;      // number of fields in current line
-    uchar_t                 min_base_quality;
-    uchar_t                 min_map_quality;
-
-public:
-
-    std::string             line;  // mpileup line we're currently working on
-
-    std::vector<std::string> fields;  // fields of mpileup line
     enum { F_ref=0, F_pos, F_refbase, F_cov, F_base_call, F_base_q, F_map_q, F_END };
 
-    std::vector<std::string> references;  // reference sequences named in the pileup
+    Diagnostics             diagnostics;  // problems found in the input
 
-    ReadStack               read_stack;
+    ParserStats             stats;
 
     Pileup                  pileup;
 
-    uchar_t                 min_base_quality_seen;
-    uchar_t                 max_base_quality_seen;
-    uchar_t                 min_map_quality_seen;
-    uchar_t                 max_map_quality_seen;
-
     // ctor, dtor
     PileupParser(const std::string& fname);
     PileupParser();
@@ -367,26 +672,92 @@ public:
 
     void                    open(const std::string& fname);
     void                    close();
+    bool                    scan(size_t n_lines = 1000, size_t n_offsets = 8);
+    const PileupScan&       scanned() const { return(last_scan); }  // by the last scan()
+    void                    configure(const ParserConfig& config);
     int                     read_line();
     void                    parse_line();
     void                    parse_line_lite();
-    void                    parse_pile();
+    size_t                  line_number() const { return(NL); }
 
     void                    print_read_stack(std::ostream& os = std::cerr) const;
 
     void                    print(std::ostream& os = std::cerr) const;
     void                    print_lite(std::ostream& os = std::cerr,
                                         const std::string sep = "\t") const;
-    void                    scan(size_t n_lines = 1000);
 
-    void                    update_qualities_seen();
+    void                    memory_usage(MemoryUsage& mem) const;
+    void                    release_memory();     // shrink containers to the current line
+    void                    forget_references();  // keep only the current reference
+
+    friend std::ostream&    operator<<(std::ostream& os,
+                                        const PileupParser& parser);
+    friend class            smorgas::Analysis;
+
+private:
+    std::ifstream           stream;  // stream we're reading from
+    std::string             filename; // filename, if one was given
+    const char              FS;      // input field separator
+    const char              RS;      // input line separator
+    size_t                  NL;      // line number within pileup file
+    int                     NF;      // number of fields in current line
+    uchar_t                 min_base_quality;  // base quality offset, 33 or 64
+    uchar_t                 min_map_quality;   // mapping quality offset, 33
+    uchar_t                 base_quality_threshold;  // for Pileup::hq_cov, after offset
+    uchar_t                 map_quality_threshold;
+
+    std::string             line;  // mpileup line we're currently working on
+
+    std::vector<std::string> fields;  // fields of mpileup line
+    bool                    has_map_q;  // each sample has a -s mapping quality column
+    int                     n_samples;  // samples in current line, each with its own columns
+
+    std::vector<std::string> references;  // reference sequences named in the pileup
+    size_t                  n_references;     // count, kept by forget_references()
+    std::unordered_set<uint64_t> reference_hashes;  // of every reference, to spot revisits
+    bool                    new_reference;    // current line starts a new reference
+    size_t                  max_pile_depth;   // 0 for none, or keep only this many strata
+    size_t                  max_depth;        // 0 for none, or sample strata down to about this many
+
+    ReadStack               read_stack;
+    ReadEndHook *           read_end_hook;  // if set, sees each read as it ends
+    LineSource *            line_source;    // if set, lines come from here, not stream
+
+    uchar_t                 min_base_quality_seen;
+    uchar_t                 max_base_quality_seen;
+    uchar_t                 min_map_quality_seen;
+    uchar_t                 max_map_quality_seen;
+
+    PileupScan              last_scan;  // results of the last scan()
 
     int                     debug_level;
     inline bool             debug(int level) { return(debug_level >= level); }
 
-
-    friend std::ostream&    operator<<(std::ostream& os,
-                                        const PileupParser& parser);
+    bool                    line_pending;  // read_line() gives the current line again
+    typedef void            (PileupParser::*parse_pile_fn_t)();
+    parse_pile_fn_t         parse_pile_fn;  // set by select_parse_policy()
+    bool                    learn_layout();  // has_map_q from the first line, if it tells
+    void                    parse_pile();
+    void                    select_parse_policy(const bool track_reads = true,
+                                                const bool keep_indels = true);
+    template<class Policy> void parse_pile_policy();
+    template<class Policy> void parse_stratum_qualities(Stratum& st,
+                                        const size_t stratum, const size_t q,
+                                        const std::string& base_quality,
+                                        const std::string& map_quality,
+                                        const bool sample_map_q,
+                                        const uchar_t base_q_offset,
+                                        const uchar_t raw_read_map_q);
+    template<class Policy> void count_sampled_out(const Stratum& st, const size_t q,
+                                        const std::string& base_quality,
+                                        const std::string& map_quality,
+                                        const bool sample_map_q,
+                                        const uchar_t base_q_offset);
+    template<class Policy> uint32_t stratum_key(const size_t stratum, const size_t rs) const;
+    template<class Policy> void sample_out(const size_t rs, size_t& n_sampled_out);
+    void                    read_unstarted(const size_t stratum, const size_t rs,
+                                           const readdir_t dir, const int16_t sample);
+    template<bool M, bool R, bool I> void select_parse_policy_offset();
 };  // class PileupParser
 
 
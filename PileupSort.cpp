@@ -0,0 +1,281 @@
+// PileupSort.cpp (c) 2026 Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// External merge sort of a pileup by (contig, position)
+//
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- compress run files when tmp_dir is short of space
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+
+#include "PileupSort.h"
+
+namespace PileupTools {
+
+
+//--------------------------------------------------------
+//--------------------------------- class PileupSort
+
+// External merge sort of a pileup, see the header
+//
+// memory       : bytes of lines held at once while writing runs; the merge
+//                of runs is given a quarter of this for its blocks
+// n_threads    : chunks sorted and written at once, while another is read
+// tmp_dir      : directory for run files, which are removed at destruction
+// fan_in       : most runs merged at once, each with a reader thread
+// runs         : run files written from chunks, 0 if the input was sorted
+//                in memory
+// merge_passes : passes merging fan_in runs into longer ones, when there
+//                were too many to merge at once
+
+PileupSort::PileupSort(const std::string& fname, const size_t mem, const int threads,
+                       const std::string& tmp)
+    : filename(fname), memory(mem), n_threads(std::max(1, threads)), tmp_dir(tmp),
+      fan_in(64), lines(0), runs(0), merge_passes(0), error(""), last_ref(""),
+      last_rank(0), in_memory(0), next_key(0), merge(0)
+{ }
+
+PileupSort::~PileupSort()
+{
+    delete merge;
+    for (size_t c = 0; c < chunks.size(); ++c)
+        if (chunks[c].thread.joinable())
+            chunks[c].thread.join();
+    for (size_t f = 0; f < temp_files.size(); ++f)
+        std::remove(temp_files[f].c_str());
+}
+
+void
+PileupSort::set_contig_order(const std::vector<std::string>& order)
+{
+    for (size_t c = 0; c < order.size(); ++c)
+        if (contig_rank.insert(std::make_pair(order[c], contigs.size())).second)
+            contigs.push_back(order[c]);
+}
+
+// Fill chunk with lines up to max_bytes, keyed by contig rank and position.
+// False at the end of the input, or with error set.
+
+bool
+PileupSort::read_chunk(std::istream& is, Chunk& chunk, const size_t max_bytes,
+                       uint64_t& bytes)
+{
+    chunk.keys.clear();
+    size_t n = 0, held = 0;
+    while (held < max_bytes) {
+        if (n == chunk.lines.size())
+            chunk.lines.push_back(std::string());
+        std::string& l = chunk.lines[n];
+        if (! getline(is, l))
+            return(false);
+        if (l.empty())
+            continue;
+        ++lines;
+        bytes += l.size() + 1;
+        const size_t t1 = l.find('\t');
+        if (t1 == std::string::npos) {
+            error = filename + " line " + std::to_string(lines) + " has too few fields";
+            return(false);
+        }
+        if (l.compare(0, t1, last_ref) != 0) {
+            last_ref.assign(l, 0, t1);
+            std::map<std::string, size_t>::const_iterator r = contig_rank.find(last_ref);
+            if (r == contig_rank.end()) {
+                r = contig_rank.insert(std::make_pair(last_ref, contigs.size())).first;
+                contigs.push_back(last_ref);
+            }
+            last_rank = r->second;
+        }
+        Key k;
+        k.rank = last_rank;
+        k.pos = strtoul(l.c_str() + t1 + 1, NULL, 10);
+        k.index = n++;
+        chunk.keys.push_back(k);
+        held += l.capacity() + sizeof(std::string) + sizeof(Key);
+    }
+    return(true);
+}
+
+// Sort a chunk and write it to its run file, on a thread of its own
+
+void
+PileupSort::write_run(Chunk* chunk)
+{
+    std::sort(chunk->keys.begin(), chunk->keys.end());
+    std::ofstream os(chunk->file.c_str());
+    for (size_t k = 0; k < chunk->keys.size() and os; ++k) {
+        const std::string& l = chunk->lines[chunk->keys[k].index];
+        os.write(l.data(), l.size());
+        os.put('\n');
+    }
+    os.close();
+    chunk->ok = ! os.fail();
+}
+
+bool
+PileupSort::temp_file(std::string& name)
+{
+    std::string t = tmp_dir + "/smorgas-sort-XXXXXX";
+    std::vector<char> buf(t.begin(), t.end());
+    buf.push_back('\0');
+    const int fd = mkstemp(&buf[0]);
+    if (fd < 0) {
+        error = "could not create a run file in " + tmp_dir;
+        return(false);
+    }
+    close(fd);
+    name = &buf[0];
+    temp_files.push_back(name);
+    return(true);
+}
+
+// Lines in each block read ahead from n_runs runs merged at once, so all of
+// their blocks fit within a quarter of memory; bytes is the size of the input
+
+size_t
+PileupSort::run_block_lines(const size_t n_runs, const uint64_t bytes) const
+{
+    const size_t line_bytes = lines ? std::max(uint64_t(1), bytes / lines) : 1;
+    const size_t per_run = memory / 4 / std::max(size_t(1), n_runs) / 4;
+    return(std::min(size_t(1024), std::max(size_t(16), per_run / line_bytes)));
+}
+
+// Merge sorted runs in into one longer run out, for passes before the last
+
+bool
+PileupSort::merge_runs(const std::vector<std::string>& in, const std::string& out,
+                       const size_t block_lines)
+{
+    PileupMerge m(in, block_lines);
+    m.join = false;
+    m.set_contig_order(contigs);
+    std::ofstream os(out.c_str());
+    if (! m.start()) {
+        error = m.error;
+        return(false);
+    }
+    std::string l;
+    while (m.get_line(l) and os) {
+        os.write(l.data(), l.size());
+        os.put('\n');
+    }
+    os.close();
+    if (! m.error.empty())
+        error = m.error;
+    else if (os.fail())
+        error = "could not write run file " + out;
+    return(error.empty());
+}
+
+bool
+PileupSort::sort()
+{
+    std::ifstream is(filename.c_str());
+    if (! is) {
+        error = "could not open " + filename;
+        return(false);
+    }
+    // memory is split between the chunk being read and those being written;
+    // smaller chunks would make more runs than they are worth
+    const size_t max_chunks = memory / min_chunk_bytes;
+    if (max_chunks < 2) {
+        error = "sorting needs at least " + std::to_string(2 * min_chunk_bytes)
+                + " bytes of memory, not " + std::to_string(memory);
+        return(false);
+    }
+    n_threads = int(std::min(size_t(n_threads), max_chunks - 1));
+    const size_t chunk_bytes = memory / (n_threads + 1);
+    chunks.resize(n_threads + 1);
+    std::vector<std::string> run_files;
+    uint64_t bytes = 0;
+
+    for (size_t c = 0; ; ++c) {
+        Chunk& chunk = chunks[c % chunks.size()];
+        if (chunk.thread.joinable()) {  // its run is written, so it can be reused
+            chunk.thread.join();
+            if (! chunk.ok) {
+                error = "could not write run file " + chunk.file;
+                break;
+            }
+        }
+        const bool more = read_chunk(is, chunk, chunk_bytes, bytes);
+        if (! error.empty())
+            break;
+        if (! more and c == 0) {  // all of it fit in memory
+            std::sort(chunk.keys.begin(), chunk.keys.end());
+            in_memory = &chunk;
+            return(true);
+        }
+        if (! chunk.keys.empty()) {
+            if (! temp_file(chunk.file))
+                break;
+            run_files.push_back(chunk.file);
+            chunk.ok = false;
+            chunk.thread = std::thread(&PileupSort::write_run, &chunk);
+        }
+        if (! more)
+            break;
+    }
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        if (chunks[c].thread.joinable()) {
+            chunks[c].thread.join();
+            if (! chunks[c].ok and error.empty())
+                error = "could not write run file " + chunks[c].file;
+        }
+    }
+    // the chunks are done with, so give their memory to the merge
+    std::vector<Chunk>().swap(chunks);
+    if (! error.empty())
+        return(false);
+    runs = run_files.size();
+
+    while (run_files.size() > fan_in) {
+        std::vector<std::string> in(run_files.begin(), run_files.begin() + fan_in);
+        std::string out;
+        if (! temp_file(out) or ! merge_runs(in, out, run_block_lines(in.size(), bytes)))
+            return(false);
+        for (size_t f = 0; f < in.size(); ++f)
+            std::remove(in[f].c_str());  // as soon as possible, for disk space
+        run_files.erase(run_files.begin(), run_files.begin() + fan_in);
+        run_files.push_back(out);
+        ++merge_passes;
+    }
+
+    merge = new PileupMerge(run_files, run_block_lines(run_files.size(), bytes));
+    merge->join = false;
+    merge->set_contig_order(contigs);
+    if (! merge->start()) {
+        error = merge->error;
+        return(false);
+    }
+    return(true);
+}
+
+bool
+PileupSort::get_line(std::string& line)
+{
+    if (in_memory) {
+        if (next_key == in_memory->keys.size())
+            return(false);
+        line = in_memory->lines[in_memory->keys[next_key++].index];
+        return(true);
+    }
+    if (! merge or ! merge->get_line(line)) {
+        if (merge and ! merge->error.empty())
+            error = merge->error;
+        return(false);
+    }
+    return(true);
+}
+
+
+} // namespace PileupTools
+
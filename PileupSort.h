@@ -0,0 +1,108 @@
+// PileupSort.h (c) 2026 Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// External merge sort of a pileup by (contig, position)
+//
+// The input is read in chunks of at most memory / (threads + 1) bytes.  Each
+// chunk is sorted and written to a temporary run file on a thread of its own
+// while the next chunk is read, so at most threads chunks are in flight.
+// Chunks are at least 1 MiB, so with less memory fewer threads are used, and
+// less than 2 MiB is too little to sort with.
+// The runs are then merged by PileupMerge, passing lines through unjoined,
+// fan_in runs at a time; if there are more, earlier passes merge them into
+// longer runs first.  An input that fits in one chunk is sorted in memory and
+// never written out.
+//
+// Contigs are ordered as given to set_contig_order(), and any not given
+// follow in the order first seen in the input, so shards of a pileup that
+// were scattered or interleaved come back in their contig order.  Lines at
+// the same position stay in input order.
+
+#ifndef _PILEUPSORT_H_
+#define _PILEUPSORT_H_
+
+// Std C/C++ includes
+#include <fstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <thread>
+#include <stdint.h>
+
+#include "PileupParser.h"
+#include "PileupMerge.h"
+
+namespace PileupTools {
+
+
+//---------------------------------------------------------------
+//--------------------- PileupSort class
+
+
+class PileupSort : public LineSource {
+public:
+    PileupSort(const std::string& fname,
+               const size_t mem = size_t(1) << 30,
+               const int threads = 1,
+               const std::string& tmp = "/tmp");
+    ~PileupSort();
+
+    std::string             filename;
+    size_t                  memory;      // bytes of lines held at once
+    int                     n_threads;   // chunks sorted and written at once, cut by sort()
+    static const size_t     min_chunk_bytes = size_t(1) << 20;
+    std::string             tmp_dir;     // where run files go
+    size_t                  fan_in;      // most runs merged at once
+    uint64_t                lines;       // lines sorted
+    size_t                  runs;        // run files written, 0 if sorted in memory
+    size_t                  merge_passes; // passes over the runs before the last
+    std::string             error;       // why sort() or get_line() failed
+
+    void                    set_contig_order(const std::vector<std::string>& contigs);
+    bool                    sort();      // read and sort the input, false with error set
+    virtual bool            get_line(std::string& line);
+
+private:
+    class Key {
+    public:
+        size_t              rank;
+        size_t              pos;
+        size_t              index;       // into Chunk::lines
+        bool                operator<(const Key& o) const {
+                                return(rank != o.rank ? rank < o.rank
+                                       : pos != o.pos ? pos < o.pos : index < o.index);
+                            }
+    };
+
+    class Chunk {
+    public:
+        std::vector<std::string> lines;  // keep their capacity from chunk to chunk
+        std::vector<Key>    keys;
+        std::string         file;        // run written from this chunk
+        std::thread         thread;      // writing the run
+        bool                ok;
+    };
+
+    std::map<std::string, size_t> contig_rank;
+    std::vector<std::string> contigs;    // in rank order
+    std::string             last_ref;    // contig and rank of the line before
+    size_t                  last_rank;
+    std::vector<Chunk>      chunks;
+    Chunk*                  in_memory;   // the only chunk, if the input fit in one
+    size_t                  next_key;    // next line of in_memory to serve
+    std::vector<std::string> temp_files; // every run file, removed at destruction
+    PileupMerge*            merge;
+
+    bool                    read_chunk(std::istream& is, Chunk& chunk, const size_t max_bytes,
+                                       uint64_t& bytes);
+    static void             write_run(Chunk* chunk);
+    bool                    temp_file(std::string& name);
+    bool                    merge_runs(const std::vector<std::string>& in, const std::string& out,
+                                       const size_t block_lines);
+    size_t                  run_block_lines(const size_t n_runs, const uint64_t bytes) const;
+};
+
+
+} // namespace PileupTools
+
+
+#endif // _PILEUPSORT_H_
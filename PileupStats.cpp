@@ -0,0 +1,636 @@
+// PileupStats.cpp (c) Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// Accumulators that digest parsed pileup into summaries for smorgas reports
+//
+
+// CHANGELOG
+//
+//
+//
+// TODO
+//
+
+#include "PileupStats.h"
+
+#include "PileupKernels.h"
+
+namespace PileupTools {
+
+
+//--------------------------------------------------------
+//--------------------------------- class SampleTally
+
+// Counts for one sample, either at a single position or summed over many
+//
+// positions : positions at which the sample has coverage
+// cov       : coverage as reported in the sample's cov column
+// depth     : strata parsed from the sample's base call column
+// mapq0     : strata with mapping quality 0
+// mapq60    : strata with mapping quality 60
+// nonref    : strata with a base (not a gap) that does not match the reference
+// gaps      : strata that continue a deletion, '*' in the base call column
+// indels    : strata that declare an indel
+// bases     : strata for each of A, C, G, T, N, indexed by B_A etc.
+
+SampleTally::SampleTally()
+{
+    reset();
+}
+
+SampleTally::~SampleTally()
+{ }
+
+void
+SampleTally::reset()
+{
+    positions = cov = depth = mapq0 = mapq60 = nonref = gaps = indels = 0;
+    for (int b = 0; b < B_END; ++b) bases[b] = 0;
+}
+
+void
+SampleTally::add(const SampleTally& other)
+{
+    positions += other.positions;
+    cov += other.cov;
+    depth += other.depth;
+    mapq0 += other.mapq0;
+    mapq60 += other.mapq60;
+    nonref += other.nonref;
+    gaps += other.gaps;
+    indels += other.indels;
+    for (int b = 0; b < B_END; ++b) bases[b] += other.bases[b];
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class SampleSummary
+
+// Splits the pile at each position by sample, using the sample recorded in
+// each Stratum, so that every report can be broken down by library in the
+// same pass through the pileup.  The cost per position is one pass over the
+// pile plus one pass over the samples.
+//
+// position : tallies for the position most recently passed to add()
+// total    : tallies summed over every position passed to add()
+// contig   : tallies summed over positions passed since start_contig(), so
+//            that per-contig results can be kept by a cache
+
+SampleSummary::SampleSummary()
+{ }
+
+SampleSummary::~SampleSummary()
+{ }
+
+size_t
+SampleSummary::memory_bytes() const
+{
+    return((position.capacity() + total.capacity() + contig.capacity()) * sizeof(SampleTally));
+}
+
+void
+SampleSummary::add(const Pileup& pileup)
+{
+    const size_t n = pileup.n_samples;
+    if (position.size() != n) position.resize(n);
+    if (total.size() < n) total.resize(n);
+    if (contig.size() < n) contig.resize(n);
+    for (size_t s = 0; s < n; ++s) {
+        position[s].reset();
+        position[s].cov = pileup.sample_cov[s];
+        position[s].positions = (pileup.sample_cov[s] > 0);
+    }
+    for (Pile::const_iterator citer = pileup.pile.begin(); citer != pileup.pile.end(); ++citer) {
+        SampleTally& t = position[citer->sample];
+        ++t.depth;
+        if (citer->map_q == 60) ++t.mapq60;
+        else if (citer->map_q == 0) ++t.mapq0;
+        if (citer->indel) ++t.indels;
+        if (citer->base == '*') {
+            ++t.gaps;
+            continue;
+        }
+        const int b = baseIndex(citer->base);
+        if (b >= 0) ++t.bases[b];
+        if (citer->base != pileup.refbase) ++t.nonref;
+    }
+    for (size_t s = 0; s < n; ++s) {
+        total[s].add(position[s]);
+        contig[s].add(position[s]);
+    }
+}
+
+void
+SampleSummary::add_total(const SampleTallies& other)
+{
+    if (total.size() < other.size()) total.resize(other.size());
+    for (size_t s = 0; s < other.size(); ++s)
+        total[s].add(other[s]);
+}
+
+void
+SampleSummary::print(std::ostream& os, const std::string sep) const
+{
+    os << "#sample" << sep << "positions" << sep << "cov" << sep << "mean_cov"
+        << sep << "mapq0" << sep << "mapq60" << sep << "nonref" << sep << "gaps"
+        << sep << "indels" << sep << "A" << sep << "C" << sep << "G" << sep << "T"
+        << sep << "N" << std::endl;
+    for (size_t s = 0; s < total.size(); ++s) {
+        const SampleTally& t = total[s];
+        os << s << sep << t.positions << sep << t.cov
+            << sep << (t.positions ? (double(t.cov) / t.positions) : 0)
+            << sep << t.mapq0 << sep << t.mapq60 << sep << t.nonref << sep << t.gaps
+            << sep << t.indels;
+        for (int b = 0; b < B_END; ++b) os << sep << t.bases[b];
+        os << std::endl;
+    }
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class Histogram
+
+// counts    : count for each bin, the last bin also holds everything beyond it
+// bin_width : width of each bin in units of the value added
+
+Histogram::Histogram(const size_t n_bins, const size_t bin_width)
+    : counts(n_bins, 0), bin_width(bin_width)
+{ }
+
+Histogram::~Histogram()
+{ }
+
+void
+Histogram::add(const Histogram& other)
+{
+    for (size_t b = 0; b < counts.size() and b < other.counts.size(); ++b)
+        counts[b] += other.counts[b];
+}
+
+void
+Histogram::reset()
+{
+    std::fill(counts.begin(), counts.end(), 0);
+}
+
+uint64_t
+Histogram::total() const
+{
+    uint64_t ans = 0;
+    for (size_t b = 0; b < counts.size(); ++b) ans += counts[b];
+    return(ans);
+}
+
+void
+Histogram::print(std::ostream& os, const std::string sep) const
+{
+    // trailing empty bins are not printed
+    size_t n = counts.size();
+    while (n > 1 and counts[n - 1] == 0) --n;
+    for (size_t b = 0; b < n; ++b) os << (b ? sep : "") << counts[b];
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class QualHistogram
+
+// counts  : count of each raw quality character
+// n       : number of characters counted
+// offset  : subtracted from raw characters when queried, samtools uses +33
+// raw_min : smallest raw character counted
+// raw_max : largest raw character counted
+
+QualHistogram::QualHistogram(const uchar_t off)
+    : n(0), offset(off), raw_min(0xff), raw_max(0x00)
+{
+    std::fill(counts, counts + 256, 0);
+}
+
+QualHistogram::~QualHistogram()
+{ }
+
+void
+QualHistogram::reset()
+{
+    if (n)
+        std::fill(counts + raw_min, counts + raw_max + 1, 0);
+    n = 0;
+    raw_min = 0xff;
+    raw_max = 0x00;
+}
+
+void
+QualHistogram::add(const std::string& raw)
+{
+    add(raw.data(), raw.length());
+}
+
+void
+QualHistogram::add(const char* raw, const size_t len)
+{
+    kernels().histogram(raw, len, counts, raw_min, raw_max);
+    n += len;
+}
+
+void
+QualHistogram::add_map_q(const Pileup& pileup)
+{
+    for (int s = 0; s < pileup.n_samples; ++s)
+        if (pileup.sample_cov[s] > 0)  // otherwise the column may hold '*'
+            add(*pileup.sample_map_quality[s]);
+}
+
+void
+QualHistogram::add_pile_map_q(const Pileup& pileup)
+{
+    uchar_t lo = raw_min, hi = raw_max;
+    for (Pile::const_iterator citer = pileup.pile.begin(); citer != pileup.pile.end(); ++citer) {
+        const uchar_t r = uchar_t(std::min(int(citer->map_q) + offset, 0xff));
+        ++counts[r];
+        if (r < lo) lo = r;
+        if (r > hi) hi = r;
+    }
+    raw_min = lo;
+    raw_max = hi;
+    n += pileup.pile.size();
+}
+
+uint32_t
+QualHistogram::count_at(const int q) const
+{
+    const int r = q + offset;
+    return((r < 0 or r > 0xff) ? 0 : counts[r]);
+}
+
+uint32_t
+QualHistogram::count_at_least(const int q) const
+{
+    if (n == 0) return 0;
+    int r = std::max(q + int(offset), int(raw_min));
+    uint32_t ans = 0;
+    for (; r <= int(raw_max); ++r) ans += counts[r];
+    return(ans);
+}
+
+int
+QualHistogram::quantile(const double p) const
+{
+    // smallest quality at or below which at least p of the counts fall
+    if (n == 0) return -1;
+    const double target = p * n;
+    uint32_t cum = 0;
+    for (int r = raw_min; r <= int(raw_max); ++r) {
+        cum += counts[r];
+        if (cum >= target and cum > 0) return(r - offset);
+    }
+    return(int(raw_max) - offset);
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class HqCoverage
+
+// out        : stream to which positions or windows are printed
+// window     : window size in bp, 0 to print each position
+// base_off   : base and mapping quality offsets of the raw columns
+// map_off
+// min_base_q : thresholds for high quality, in quality units; 0 passes every
+// min_map_q    stratum, even one whose quality character is below the offset
+
+static inline uchar_t
+raw_threshold(const int q, const uchar_t offset)
+{
+    return(q <= 0 ? 0 : uchar_t(std::min(q + int(offset), 0xff)));
+}
+
+static inline double
+hq_fraction(const uint64_t hq, const uint64_t cov)
+{
+    return(cov ? double(hq) / cov : 0.0);
+}
+
+HqCoverage::HqCoverage(std::ostream& os, const size_t win, const uchar_t base_off,
+                       const uchar_t map_off, const int min_base_q, const int min_map_q)
+    : out(os), window(win), from_pile(false), by_sample(false),
+      cov(0), hq_cov(0),
+      raw_base_q(raw_threshold(min_base_q, base_off)),
+      raw_map_q(raw_threshold(min_map_q, map_off)),
+      ref(""), win_index(0), win_positions(0), win_cov(0), win_hq_cov(0)
+{ }
+
+HqCoverage::~HqCoverage()
+{ }
+
+// Each sample's quality columns are compared a vector at a time, both
+// thresholds at once; strata without a mapping quality character, in a
+// column cut short, do not pass a mapping quality threshold
+
+void
+HqCoverage::count(const Pileup& pileup)
+{
+    const Kernels& kern = kernels();
+    sample_cov.resize(pileup.n_samples);
+    sample_hq_cov.resize(pileup.n_samples);
+    cov = pileup.cov;
+    hq_cov = 0;
+    for (int s = 0; s < pileup.n_samples; ++s) {
+        sample_cov[s] = std::max(pileup.sample_cov[s], 0);
+        if (from_pile)
+            sample_hq_cov[s] = pileup.sample_hq_cov[s];
+        else if (pileup.sample_cov[s] <= 0)  // otherwise the columns may hold '*'
+            sample_hq_cov[s] = 0;
+        else {
+            const std::string& bq = *pileup.sample_base_quality[s];
+            const std::string& mq = *pileup.sample_map_quality[s];
+            sample_hq_cov[s] = raw_map_q
+                ? kern.count_both_at_least(bq.data(), mq.data(), std::min(bq.size(), mq.size()),
+                                           raw_base_q, raw_map_q)
+                : kern.count_at_least(bq.data(), bq.size(), raw_base_q);
+        }
+        hq_cov += sample_hq_cov[s];
+    }
+}
+
+void
+HqCoverage::add(const Pileup& pileup)
+{
+    count(pileup);
+    const char tab = '\t';
+    if (! window) {
+        out << pileup.ref << tab << pileup.pos << tab << cov << tab << hq_cov
+            << tab << hq_fraction(hq_cov, cov);
+        if (by_sample)
+            for (int s = 0; s < pileup.n_samples; ++s)
+                out << tab << sample_cov[s] << tab << sample_hq_cov[s];
+        out << std::endl;
+        return;
+    }
+    const size_t w = (pileup.pos - 1) / window;
+    if (pileup.ref != ref or w != win_index) {
+        flush_window();
+        ref = pileup.ref;
+        win_index = w;
+    }
+    ++win_positions;
+    win_cov += cov;
+    win_hq_cov += hq_cov;
+    if (win_sample_cov.size() < sample_cov.size()) {
+        win_sample_cov.resize(sample_cov.size(), 0);
+        win_sample_hq_cov.resize(sample_cov.size(), 0);
+    }
+    for (size_t s = 0; s < sample_cov.size(); ++s) {
+        win_sample_cov[s] += sample_cov[s];
+        win_sample_hq_cov[s] += sample_hq_cov[s];
+    }
+}
+
+void
+HqCoverage::finish()
+{
+    flush_window();
+    ref = "";
+}
+
+void
+HqCoverage::flush_window()
+{
+    if (! window or win_positions == 0) return;
+    const char tab = '\t';
+    out << ref << tab << (win_index * window + 1) << tab << ((win_index + 1) * window)
+        << tab << win_positions << tab << win_cov << tab << win_hq_cov
+        << tab << hq_fraction(win_hq_cov, win_cov);
+    if (by_sample)
+        for (size_t s = 0; s < win_sample_cov.size(); ++s)
+            out << tab << win_sample_cov[s] << tab << win_sample_hq_cov[s];
+    out << std::endl;
+    win_positions = win_cov = win_hq_cov = 0;
+    win_sample_cov.assign(win_sample_cov.size(), 0);
+    win_sample_hq_cov.assign(win_sample_hq_cov.size(), 0);
+}
+
+void
+HqCoverage::print_header(const int n_samples) const
+{
+    out << "#ref";
+    if (window)
+        out << "\tstart\tend\tpositions";
+    else
+        out << "\tpos";
+    out << "\tcov\thq_cov\thq_frac";
+    if (by_sample)
+        for (int s = 0; s < n_samples; ++s)
+            out << "\tcov_" << s << "\thq_cov_" << s;
+    out << std::endl;
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class ReadTally
+
+// Summary of reads that have ended within a contig or window
+//
+// reads          : reads ended
+// fwd, rev       : reads ended in each orientation
+// aligned_length : histogram of aligned length, 10-bp bins up to 1000 bp
+// bp_gap         : histogram of bp of deletions within reads, up to 63 bp
+// bp_insert      : histogram of bp of insertions within reads, up to 63 bp
+// map_q          : histogram of read mapping quality from the ^q digraph
+
+ReadTally::ReadTally()
+    : reads(0), fwd(0), rev(0),
+      aligned_length(100, 10), bp_gap(64), bp_insert(64), map_q(64)
+{ }
+
+ReadTally::~ReadTally()
+{ }
+
+void
+ReadTally::reset()
+{
+    reads = fwd = rev = 0;
+    aligned_length.reset();
+    bp_gap.reset();
+    bp_insert.reset();
+    map_q.reset();
+}
+
+size_t
+ReadTally::memory_bytes() const
+{
+    return(aligned_length.memory_bytes() + bp_gap.memory_bytes()
+           + bp_insert.memory_bytes() + map_q.memory_bytes());
+}
+
+void
+ReadTally::add(const ReadTally& other)
+{
+    reads += other.reads;
+    fwd += other.fwd;
+    rev += other.rev;
+    aligned_length.add(other.aligned_length);
+    bp_gap.add(other.bp_gap);
+    bp_insert.add(other.bp_insert);
+    map_q.add(other.map_q);
+}
+
+
+//--------------------------------------------------------
+//--------------------------------- class ReadStats
+
+// out          : stream to which contig and window tallies are printed
+// window       : window size in bp, 0 to only print contig tallies
+// by_sample    : also print a tally for each sample, after the one for all
+// kept         : if set, every tally printed is also added here
+
+ReadStats::ReadStats(std::ostream& os, const size_t win)
+    : out(os), window(win), by_sample(false),
+      ref(""), last_pos(0), win_index(0), kept(0)
+{ }
+
+ReadStats::~ReadStats()
+{ }
+
+size_t
+ReadStats::memory_bytes() const
+{
+    size_t b = ref.capacity() + contig.memory_bytes() + win_tally.memory_bytes();
+    for (size_t s = 0; s < contig_samples.size(); ++s)
+        b += contig_samples[s].memory_bytes() + win_samples[s].memory_bytes();
+    return(b);
+}
+
+static void
+tally_read(ReadTally& t, const Read& read)
+{
+    ++t.reads;
+    if (read.dir == RD_fwd) ++t.fwd;
+    else if (read.dir == RD_rev) ++t.rev;
+    t.aligned_length.add(read.aligned_length);
+    t.bp_gap.add(read.bp_gap > 0 ? read.bp_gap : 0);
+    t.bp_insert.add(read.bp_insert > 0 ? read.bp_insert : 0);
+    t.map_q.add(read.map_q);
+}
+
+void
+ReadStats::read_end(const Read& read, const Pileup& pileup)
+{
+    if (pileup.ref != ref) {
+        if (! ref.empty()) {
+            flush_window();
+            flush_contig();
+        }
+        ref = pileup.ref;
+        win_index = 0;
+    }
+    if (window) {
+        const size_t w = (read.end_pos - 1) / window;
+        if (w != win_index) {
+            flush_window();
+            win_index = w;
+        }
+    }
+    last_pos = read.end_pos;
+    tally_read(window ? win_tally : contig, read);
+    if (by_sample and read.sample >= 0) {
+        if (size_t(read.sample) >= contig_samples.size()) {
+            contig_samples.resize(read.sample + 1);
+            win_samples.resize(read.sample + 1);
+        }
+        tally_read(window ? win_samples[read.sample] : contig_samples[read.sample], read);
+    }
+}
+
+void
+ReadStats::finish()
+{
+    if (ref.empty()) return;
+    flush_window();
+    flush_contig();
+    ref = "";
+}
+
+void
+ReadStats::flush_window()
+{
+    if (! window or win_tally.reads == 0) return;
+    const size_t start = win_index * window + 1, end = (win_index + 1) * window;
+    emit("window", -1, start, end, win_tally);
+    contig.add(win_tally);
+    win_tally.reset();
+    for (size_t s = 0; s < win_samples.size(); ++s) {
+        if (win_samples[s].reads)
+            emit("window", int(s), start, end, win_samples[s]);
+        contig_samples[s].add(win_samples[s]);
+        win_samples[s].reset();
+    }
+}
+
+void
+ReadStats::flush_contig()
+{
+    if (contig.reads)
+        emit("contig", -1, 1, last_pos, contig);
+    contig.reset();
+    for (size_t s = 0; s < contig_samples.size(); ++s) {
+        if (contig_samples[s].reads)
+            emit("contig", int(s), 1, last_pos, contig_samples[s]);
+        contig_samples[s].reset();
+    }
+}
+
+// Print a tally, and keep it if asked
+
+void
+ReadStats::emit(const std::string& level, const int sample, const size_t start,
+                const size_t end, const ReadTally& tally)
+{
+    print_tally(level, sample, start, end, tally);
+    if (kept)
+        kept->push_back(KeptTally{ level, sample, start, end, tally });
+}
+
+void
+ReadStats::print_header() const
+{
+    out << "#level\tref" << (by_sample ? "\tsample" : "") << "\tstart\tend\treads\tfwd\trev"
+        << "\taligned_length_10bp\tbp_gap\tbp_insert\tmap_q" << std::endl;
+}
+
+// Print tallies kept from an earlier run, as they were printed for contig
+
+void
+ReadStats::print_kept(const std::string& contig, const std::vector<KeptTally>& tallies)
+{
+    const std::string r = ref;
+    ref = contig;
+    for (size_t i = 0; i < tallies.size(); ++i)
+        print_tally(tallies[i].level, tallies[i].sample, tallies[i].start, tallies[i].end,
+                    tallies[i].tally);
+    ref = r;
+}
+
+void
+ReadStats::print_tally(const std::string& level, const int sample, const size_t start,
+                       const size_t end, const ReadTally& tally) const
+{
+    const char tab = '\t';
+    out << level << tab << ref;
+    if (by_sample) {
+        out << tab;
+        if (sample < 0) out << "all";
+        else out << sample;
+    }
+    out << tab << start << tab << end;
+    out << tab << tally.reads << tab << tally.fwd << tab << tally.rev << tab;
+    tally.aligned_length.print(out);
+    out << tab;
+    tally.bp_gap.print(out);
+    out << tab;
+    tally.bp_insert.print(out);
+    out << tab;
+    tally.map_q.print(out);
+    out << std::endl;
+}
+
+
+} // namespace PileupTools
+
@@ -0,0 +1,274 @@
+// PileupStats.h (c) Douglas G. Scofield, Evolutionary Biology Centre, Uppsala University
+//
+// Accumulators that digest parsed pileup into summaries for smorgas reports
+//
+// These are kept apart from PileupParser so that the parser stays concerned
+// with parsing; each accumulator is fed from a parsed Pileup and costs at most
+// one pass over the pile per position.
+
+#ifndef _PILEUPSTATS_H_
+#define _PILEUPSTATS_H_
+
+// Std C/C++ includes
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "PileupParser.h"
+
+namespace PileupTools {
+
+
+//---------------------------------------------------------------
+//--------------------- SampleTally and SampleSummary classes
+
+
+class SampleTally {
+public:
+    SampleTally();
+    ~SampleTally();
+
+    size_t                  positions;  // positions with coverage
+    size_t                  cov;        // coverage as reported in the pileup
+    size_t                  depth;      // strata parsed
+    size_t                  mapq0;      // strata with mapping quality 0
+    size_t                  mapq60;     // strata with mapping quality 60
+    size_t                  nonref;     // strata with a base not matching the reference
+    size_t                  gaps;       // strata that are continuations of deletions
+    size_t                  indels;     // strata declaring an indel
+    size_t                  bases[B_END];
+
+    void                    reset();
+    void                    add(const SampleTally& other);
+};
+typedef std::vector<SampleTally> SampleTallies;
+
+
+class SampleSummary {
+public:
+    SampleSummary();
+    ~SampleSummary();
+
+    SampleTallies           position;  // tallies for the most recently added position
+    SampleTallies           total;     // running tallies over all positions added
+    SampleTallies           contig;    // running tallies since start_contig()
+
+    void                    add(const Pileup& pileup);
+    void                    add_total(const SampleTallies& other);  // for positions not added
+    void                    start_contig() { contig.clear(); }
+    size_t                  memory_bytes() const;
+
+    void                    print(std::ostream& os = std::cout,
+                                  const std::string sep = "\t") const;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- Histogram class
+
+
+// Fixed number of fixed-width bins, values beyond the last bin are counted
+// in the last bin.  add() is O(1) and never allocates.
+
+class Histogram {
+public:
+    Histogram(const size_t n_bins = 64, const size_t bin_width = 1);
+    ~Histogram();
+
+    std::vector<uint32_t>   counts;
+    size_t                  bin_width;
+
+    inline void             add(const size_t x) {
+                                size_t b = x / bin_width;
+                                ++counts[b < counts.size() ? b : counts.size() - 1];
+                            }
+    void                    add(const Histogram& other);
+    void                    reset();
+    uint64_t                total() const;
+    size_t                  memory_bytes() const { return(counts.capacity() * sizeof(uint32_t)); }
+
+    void                    print(std::ostream& os = std::cout,
+                                  const std::string sep = ",") const;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- QualHistogram class
+
+
+// A 256-bin histogram of raw quality characters, filled straight from an
+// unparsed quality column such as Pileup::raw_map_quality without going
+// through the pile.  The offset (33 for samtools mapping quality) is only
+// applied when the histogram is queried.  reset() only clears the bins
+// between the min and max seen, so reusing one per position is cheap.
+// Without -s columns, add_pile_map_q() fills it from the parsed pile instead.
+
+class QualHistogram {
+public:
+    QualHistogram(const uchar_t off = 33);
+    ~QualHistogram();
+
+    uint32_t                counts[256];
+    uint32_t                n;
+    uchar_t                 offset;
+    uchar_t                 raw_min;
+    uchar_t                 raw_max;
+
+    void                    reset();
+    void                    add(const std::string& raw);
+    void                    add(const char* raw, const size_t len);
+    void                    add_map_q(const Pileup& pileup);  // every sample's -s column
+    void                    add_pile_map_q(const Pileup& pileup);  // each stratum's map_q
+
+    // queries, in quality units (raw minus offset)
+    int                     min() const { return(n ? int(raw_min) - offset : -1); }
+    int                     max() const { return(n ? int(raw_max) - offset : -1); }
+    uint32_t                count_at(const int q) const;
+    uint32_t                count_at_least(const int q) const;
+    int                     quantile(const double p) const;
+};
+
+
+//---------------------------------------------------------------
+//--------------------- HqCoverage class
+
+
+// High-quality coverage: strata with at least min_base_q base quality and
+// min_map_q mapping quality, against coverage, for each position or summed
+// over each window of that many bp.  With -s columns the strata are counted straight
+// from each sample's raw quality columns by the byte kernels, so only
+// parse_line_lite() is needed; without them mapping qualities come from the
+// read stack, and from_pile must be set to take the counts the parser made
+// with the same thresholds, Pileup::sample_hq_cov.  Either way every stratum
+// is counted, whatever --max-memory and --max-depth leave in the pile.
+
+class HqCoverage {
+public:
+    HqCoverage(std::ostream& os = std::cout,
+               const size_t win = 0,
+               const uchar_t base_off = 33,
+               const uchar_t map_off = 33,
+               const int min_base_q = 0,
+               const int min_map_q = 0);
+    ~HqCoverage();
+
+    std::ostream&           out;
+    size_t                  window;      // window size, 0 for each position
+    bool                    from_pile;   // take the parser's counts, not the raw columns
+    bool                    by_sample;   // add columns for each sample
+
+    // the position last added
+    uint32_t                cov;
+    uint32_t                hq_cov;
+    std::vector<uint32_t>   sample_cov;
+    std::vector<uint32_t>   sample_hq_cov;
+
+    void                    add(const Pileup& pileup);  // and print, or add to its window
+    void                    finish();    // print the window pending
+    void                    print_header(const int n_samples) const;
+
+private:
+    uchar_t                 raw_base_q;  // thresholds on raw quality characters
+    uchar_t                 raw_map_q;
+
+    std::string             ref;         // current contig
+    size_t                  win_index;   // current window on ref
+    uint64_t                win_positions;
+    uint64_t                win_cov;
+    uint64_t                win_hq_cov;
+    std::vector<uint64_t>   win_sample_cov;
+    std::vector<uint64_t>   win_sample_hq_cov;
+
+    void                    count(const Pileup& pileup);
+    void                    flush_window();
+};
+
+
+//---------------------------------------------------------------
+//--------------------- ReadTally and ReadStats classes
+
+
+class ReadTally {
+public:
+    ReadTally();
+    ~ReadTally();
+
+    uint64_t                reads;
+    uint64_t                fwd;
+    uint64_t                rev;
+    Histogram               aligned_length;  // 10-bp bins
+    Histogram               bp_gap;
+    Histogram               bp_insert;
+    Histogram               map_q;
+
+    void                    reset();
+    void                    add(const ReadTally& other);
+    size_t                  memory_bytes() const;
+};
+
+
+// A tally as printed by ReadStats, kept so it can be printed again
+
+class KeptTally {
+public:
+    std::string             level;       // "contig" or "window"
+    int                     sample;      // -1 for all samples
+    size_t                  start;
+    size_t                  end;
+    ReadTally               tally;
+};
+
+
+// Streams reads as they end into ReadTally histograms for each contig and,
+// if window is set, for each window of that many bp.  Reads are assigned
+// to the window holding their end position, so windows and contigs are
+// complete, and are printed, as soon as reads end beyond them.  If by_sample
+// is set, each tally is followed by one for each sample with reads in it.
+// If kept is set, each tally printed is also added to it.
+
+class ReadStats : public ReadEndHook {
+public:
+    ReadStats(std::ostream& os = std::cout,
+              const size_t win = 0);
+    ~ReadStats();
+
+    std::ostream&           out;
+    size_t                  window;      // window size, 0 for contigs only
+    bool                    by_sample;   // also tally each sample
+
+    std::string             ref;         // current contig
+    size_t                  last_pos;    // last read end position on ref
+    ReadTally               contig;      // tallies for ref
+    std::vector<ReadTally>  contig_samples;  // and for each sample, if by_sample
+    size_t                  win_index;   // current window on ref
+    ReadTally               win_tally;   // tallies for the current window
+    std::vector<ReadTally>  win_samples;
+    std::vector<KeptTally>* kept;        // if set, tallies printed are also kept here
+
+    virtual void            read_end(const Read& read, const Pileup& pileup);
+    void                    finish();    // print anything pending
+    size_t                  memory_bytes() const;
+
+    void                    print_header() const;
+    void                    print_kept(const std::string& contig,
+                                       const std::vector<KeptTally>& tallies);
+    void                    print_tally(const std::string& level,
+                                        const int sample,
+                                        const size_t start,
+                                        const size_t end,
+                                        const ReadTally& tally) const;
+
+private:
+    void                    flush_window();
+    void                    flush_contig();
+    void                    emit(const std::string& level, const int sample, const size_t start,
+                                 const size_t end, const ReadTally& tally);
+};
+
+
+} // namespace PileupTools
+
+
+#endif // _PILEUPSTATS_H_
+